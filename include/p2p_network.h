@@ -1,6 +1,8 @@
 #pragma once
 
 #include <cinttypes>
+#include <functional>
+#include <future>
 #include <memory>
 #include <string>
 #include <tuple>
@@ -28,6 +30,24 @@ using ByteVector = std::vector<uint8_t>;
 /// id + ip + port
 using NodeEntry = std::tuple<NodeId, std::string, uint16_t>;
 
+/// Result of Manager.FindNode(id).
+struct FindNodeResult {
+  /// If true node contains contacts of id.
+  bool found = false;
+  NodeEntry node;
+
+  /// Nodes closest to id which answered during lookup, nearest first.
+  /// Partial result, it is useful when id was not found.
+  std::vector<NodeEntry> closest;
+};
+
+/// Position in paged export of known nodes,
+/// default value is the beginning, fields are opaque.
+struct KnownNodesCursor {
+  uint64_t seq = 0;
+  uint32_t slot = UINT32_MAX;
+};
+
 /// Owner of Manager must implement EventHandler's interface,
 /// see below.
 class EventHandler;
@@ -51,12 +71,25 @@ class Manager {
   void SendBroadcast(ByteVector&& msg);
   void SendBroadcastIfNoConnection(const NodeId& to, ByteVector&& msg);
 
+  /// Resolve contacts of node, from routing table if possible or by lookup.
+  /// Concurrent requests for the same id share one lookup.
+  /// Resolved contacts are cached, so following SendDirect(id) doesn't wait for discovery.
+  /// Callback is always called from internal thread, even if contacts are already known.
+  void FindNode(const NodeId&, std::function<void(FindNodeResult&&)>);
+  std::future<FindNodeResult> FindNode(const NodeId&);
+
   /// Try to connect to nodes in the passed list.
   void AddKnownNodes(const std::vector<NodeEntry>&);
 
   /// Get content of routing table.
   void GetKnownNodes(std::vector<NodeEntry>&);
 
+  /// Paged export of nodes collected with full_net_discovery, nothing otherwise.
+  /// Appends at most limit nodes seen after cursor and returns cursor of the next page.
+  /// Nodes seen again after their export are returned again, so paging on
+  /// from the last cursor later gives incremental snapshot of the network.
+  KnownNodesCursor GetKnownNodes(KnownNodesCursor, size_t limit, std::vector<NodeEntry>&);
+
   /// Censorship block.
   void Ban(const NodeId&);
   void Unban(const NodeId&);
@@ -102,5 +135,16 @@ struct ManagerConfig {
   /// If true Manager will try to traverse NAT (if exist)
   /// using UPnP device (if exist).
   bool traverse_nat = false;
+
+  /// Number of UDP sockets on listen_port, each served by its own thread.
+  /// Values greater than 1 are supported on Linux only.
+  size_t udp_shards = 1;
+
+  /// Max size of fragment Manager.StoreValue(value) splits value into.
+  size_t max_fragment_size = 64 * 1024;
+
+  /// K-bucket without lookups into its range for this time is refreshed
+  /// by lookup of random id from the range. Values below 1 are treated as 1.
+  uint32_t bucket_refresh_interval_sec = 15 * 60;
 };
 } // namespace net
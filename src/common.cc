@@ -21,23 +21,46 @@ bool operator!=(const NodeEntrance& lhs, const NodeEntrance& rhs) {
 
 void NodeEntrance::Put(Serializer& s) const {
   PutId(s);
-  s.Put(address.to_string());
-  s.Put(udp_port);
-  s.Put(tcp_port);
-  s.Put(user_data);
+
+  if (address.is_v6()) {
+    s.Put(static_cast<uint8_t>(kRecordVersion << 4 | kV6));
+    s.Put(address.to_v6().to_bytes());
+  } else {
+    s.Put(static_cast<uint8_t>(kRecordVersion << 4 | kV4));
+    s.Put(address.to_v4().to_bytes());
+  }
+
+  s.PutFixed(udp_port);
+  s.PutFixed(tcp_port);
+  s.PutVarint(user_data);
 }
 
 bool NodeEntrance::Get(Unserializer& u) {
   if (!GetId(u)) return false;
-  std::string a;
-  if (!u.Get(a)) return false;
-  boost::system::error_code err;
-  address = bi::address::from_string(a, err);
-  if (err) return false;
-  if (!u.Get(udp_port)) return false;
-  if (!u.Get(tcp_port)) return false;
-  u.Get(user_data);
-  return true;
+
+  uint8_t tag;
+  if (!u.Get(tag) || (tag >> 4) != kRecordVersion) return false;
+
+  switch (tag & 0x0f) {
+    case kV4 : {
+      bi::address_v4::bytes_type bytes;
+      if (!u.Get(bytes)) return false;
+      address = bi::make_address_v4(bytes);
+      break;
+    }
+    case kV6 : {
+      bi::address_v6::bytes_type bytes;
+      if (!u.Get(bytes)) return false;
+      address = bi::make_address_v6(bytes);
+      break;
+    }
+    default :
+      return false;
+  }
+
+  return u.GetFixed(udp_port) &&
+         u.GetFixed(tcp_port) &&
+         u.GetVarint(user_data);
 }
 
 void NodeEntrance::PutId(Serializer& s) const {
@@ -49,11 +72,11 @@ bool NodeEntrance::GetId(Unserializer& u) {
 }
 
 void Packet::PutHeader(Serializer& s) const {
-  s.Put(header.type);
-  s.Put(header.data_size);
+  s.Put(static_cast<uint8_t>(kProtocolVersion << 4 | header.type));
+  s.PutFixed(header.data_size);
   s.Put(reinterpret_cast<const uint8_t*>(header.sender.GetPtr()), header.sender.size());
   s.Put(reinterpret_cast<const uint8_t*>(header.receiver.GetPtr()), header.receiver.size());
-  s.Put(header.reserved);
+  s.PutFixed(header.reserved);
 }
 
 void Packet::Put(Serializer& s) const {
@@ -62,11 +85,14 @@ void Packet::Put(Serializer& s) const {
 }
 
 bool Packet::GetHeader(Unserializer& u) {
-  return u.Get(header.type) &&
-         u.Get(header.data_size) &&
+  uint8_t type;
+  if (!u.Get(type) || (type >> 4) != kProtocolVersion) return false;
+  header.type = static_cast<Type>(type & 0x0f);
+
+  return u.GetFixed(header.data_size) &&
          u.Get(reinterpret_cast<uint8_t*>(header.sender.GetPtr()), header.sender.size()) &&
          u.Get(reinterpret_cast<uint8_t*>(header.receiver.GetPtr()), header.receiver.size()) &&
-         u.Get(header.reserved) &&
+         u.GetFixed(header.reserved) &&
          IsHeaderValid();
 }
 
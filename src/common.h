@@ -2,6 +2,7 @@
 #define NET_COMMON_H
 
 #include <algorithm>
+#include <chrono>
 #include <cinttypes>
 #include <functional>
 #include <set>
@@ -30,6 +31,11 @@ constexpr const char* kLocalHost = "127.0.0.1";
 constexpr const char* kAllInterfaces = "0.0.0.0";
 constexpr const char* kBanFileName = "banlist.dat";
 constexpr const char* kDbPath = "p2p_db";
+constexpr const char* kRoutingTableFileName = "routing_table.dat";
+
+// Sent in high nibble of type byte of every datagram and packet,
+// messages of other versions are dropped.
+constexpr uint8_t kProtocolVersion = 1;
 
 namespace ba = boost::asio;
 namespace bi = ba::ip;
@@ -37,6 +43,15 @@ namespace bi = ba::ip;
 using DeadlineTimer = ba::deadline_timer;
 
 struct NodeEntrance {
+  // Binary record: version and address family tag, raw address bytes,
+  // udp and tcp ports, varint user data.
+  static constexpr uint8_t kRecordVersion = 1;
+
+  enum AddressFamily : uint8_t {
+    kV4 = 4,
+    kV6 = 6
+  };
+
   NodeId id;
   bi::address address;
   uint16_t udp_port;
@@ -64,6 +79,17 @@ struct Config {
   uint64_t host_data = 0;
   std::vector<NodeEntrance> custom_boot_nodes;
 
+  // Number of SO_REUSEPORT UDP sockets for discovery,
+  // each one except the first is served by its own thread.
+  size_t udp_shards = 1;
+
+  // Max size of fragment Host::StoreValue splits value into,
+  // fragments are transferred over tcp.
+  size_t max_fragment_size = 64 * 1024;
+
+  // Stale k-buckets are refreshed by lookup of random id from their range.
+  std::chrono::seconds bucket_refresh_interval{15 * 60};
+
   Config() {}
   Config(const NodeId& id) : id(id) {}
 
@@ -85,7 +111,8 @@ struct Packet {
   enum Type : uint8_t {
     kDirect = 0,
     kBroadcast = 1,
-    kRegistration
+    kRegistration,
+    kFragment // kademlia datagram with fragment
   };
 
   template<typename Ttype,
@@ -103,7 +130,7 @@ struct Packet {
       2 * sizeof(TNodeId) + sizeof(Treserved);
   };
 
-  using Header = THeader<Type, size_t, NodeId, uint32_t>;
+  using Header = THeader<Type, uint32_t, NodeId, uint32_t>;
   using Id = ByteArray<20>;
 
   void PutHeader(Serializer&) const;
@@ -115,8 +142,9 @@ struct Packet {
   bool IsDirect() const noexcept { return header.type == kDirect; }
   bool IsBroadcast() const noexcept { return header.type == kBroadcast; }
   bool IsRegistration() const noexcept { return header.type == kRegistration; }
+  bool IsFragment() const noexcept { return header.type == kFragment; }
   bool IsHeaderValid() const noexcept {
-    return IsDirect() || IsBroadcast() || IsRegistration();
+    return IsDirect() || IsBroadcast() || IsRegistration() || IsFragment();
   }
 
   Id GetId() const noexcept;
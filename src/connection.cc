@@ -116,13 +116,24 @@ void Connection::StartRead() {
                           Drop(kProtocolCorrupted);
                           return;
                         } else {
-                          registation_passed_ = true;
+                          if (active_ && packet_.header.sender != remote_node_) {
+                            LOG(DEBUG) << "Registration from unexpected node.";
+                            Drop(kProtocolCorrupted);
+                            return;
+                          }
 
                           if (!active_) {
                             remote_node_ = packet_.header.sender;
                           }
 
-                          host_.OnConnected(std::move(packet_), self);
+                          // packets pipelined after registration are accepted
+                          // only if registration is valid
+                          registation_passed_ = true;
+                          if (!host_.OnConnected(std::move(packet_), self)) {
+                            registation_passed_ = false;
+                            Drop(kProtocolCorrupted);
+                            return;
+                          }
                           packet_ = Packet();
                           StartRead();
                           return;
@@ -135,7 +146,7 @@ void Connection::StartRead() {
                         return;
                       }
 
-                      host_.OnPacketReceived(std::move(packet_));
+                      host_.OnPacketReceived(remote_node_, std::move(packet_));
                       packet_ = Packet();
                       StartRead();
                     }
@@ -182,8 +193,18 @@ void Connection::Send(Packet&& pack) {
 
 void Connection::StartWrite() {
   Ptr self(shared_from_this());
-  ba::async_write(socket_, ba::buffer(send_queue_[0]),
-      [this, self](const boost::system::error_code& err, size_t /* written length */) {
+
+  // Write all queued frames at once, so packets pipelined
+  // after registration are not delayed by Nagle's algorithm.
+  std::vector<ba::const_buffer> buffers;
+  buffers.reserve(send_queue_.size());
+  for (const auto& frame : send_queue_) {
+    buffers.push_back(ba::buffer(frame));
+  }
+  const size_t frames = buffers.size();
+
+  ba::async_write(socket_, buffers,
+      [this, self, frames](const boost::system::error_code& err, size_t /* written length */) {
         if (dropped_) {
           return;
         }
@@ -197,7 +218,7 @@ void Connection::StartWrite() {
         }
 
         Guard g(send_mux_);
-        send_queue_.pop_front();
+        send_queue_.erase(send_queue_.begin(), send_queue_.begin() + frames);
 
         if (send_queue_.empty()) return;
 
@@ -231,7 +252,11 @@ void Connection::Connect(const Endpoint& ep, Packet&& reg_pack) {
                                 return;
                               }
 
-                              StartWrite();
+                              {
+                               // senders may already queue packets into pending connection
+                               Guard g(send_mux_);
+                               StartWrite();
+                              }
                               StartRead();
                             }
   );
@@ -79,8 +79,10 @@ class Connection : public std::enable_shared_from_this<Connection> {
 
 class ConnectionOwner {
  public:
-  virtual void OnPacketReceived(Packet&&) = 0;
-  virtual void OnConnected(Packet&& conn_pack, Connection::Ptr) = 0;
+  // remote_node is the peer connection was registered with
+  virtual void OnPacketReceived(const NodeId& remote_node, Packet&&) = 0;
+  // Returns false if registration is rejected, connection is dropped then.
+  virtual bool OnConnected(Packet&& conn_pack, Connection::Ptr) = 0;
   virtual void OnConnectionDropped(const NodeId& remote_node, bool active, Connection::DropReason) = 0;
   virtual void OnPendingConnectionError(const NodeId&, Connection::DropReason) = 0;
 };
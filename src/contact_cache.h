@@ -0,0 +1,82 @@
+#ifndef NET_CONTACT_CACHE_H
+#define NET_CONTACT_CACHE_H
+
+#include <chrono>
+#include <list>
+#include <unordered_map>
+
+#include "common.h"
+
+namespace net {
+
+// Bounded LRU of contacts of recently resolved peers,
+// which are not in routing table, e.g. because their k-bucket is full.
+// Not thread safe.
+class ContactCache {
+ public:
+  ContactCache(size_t capacity, std::chrono::seconds ttl) : capacity_(capacity), ttl_(ttl) {}
+
+  void Put(const NodeEntrance&);
+  // returns false if there is no fresh contact, found one becomes most recently used
+  bool Get(const NodeId&, NodeEntrance&);
+  void Erase(const NodeId&);
+
+ private:
+  struct Entry {
+    NodeEntrance contacts;
+    std::chrono::steady_clock::time_point added;
+  };
+
+  using List = std::list<Entry>; // most recently used first
+
+  size_t capacity_;
+  std::chrono::seconds ttl_;
+  List lru_;
+  std::unordered_map<NodeId, List::iterator> index_;
+};
+
+inline void ContactCache::Put(const NodeEntrance& node) {
+  auto now = std::chrono::steady_clock::now();
+
+  auto it = index_.find(node.id);
+  if (it != index_.end()) {
+    it->second->contacts = node;
+    it->second->added = now;
+    lru_.splice(lru_.begin(), lru_, it->second);
+    return;
+  }
+
+  if (lru_.size() == capacity_) {
+    index_.erase(lru_.back().contacts.id);
+    lru_.pop_back();
+  }
+
+  lru_.push_front({node, now});
+  index_.emplace(node.id, lru_.begin());
+}
+
+inline bool ContactCache::Get(const NodeId& id, NodeEntrance& node) {
+  auto it = index_.find(id);
+  if (it == index_.end()) return false;
+
+  if (std::chrono::steady_clock::now() - it->second->added > ttl_) {
+    lru_.erase(it->second);
+    index_.erase(it);
+    return false;
+  }
+
+  lru_.splice(lru_.begin(), lru_, it->second);
+  node = it->second->contacts;
+  return true;
+}
+
+inline void ContactCache::Erase(const NodeId& id) {
+  auto it = index_.find(id);
+  if (it == index_.end()) return;
+
+  lru_.erase(it->second);
+  index_.erase(it);
+}
+
+} // namespace net
+#endif // NET_CONTACT_CACHE_H
@@ -0,0 +1,192 @@
+#include "crawler_store.h"
+
+namespace net {
+
+void CrawlerStore::Update(const NodeEntrance& node) {
+  uint32_t slot;
+  if (!index_.Find(node.id, slot)) {
+    slot = static_cast<uint32_t>(ids_.size());
+    index_.Insert(node.id, slot);
+
+    ids_.push_back(node.id);
+    addresses_.emplace_back();
+    is_v6_.push_back(0);
+    udp_ports_.push_back(0);
+    tcp_ports_.push_back(0);
+    user_data_.push_back(0);
+    last_seen_.push_back(0);
+    seqs_.push_back(0);
+    prev_.push_back(kNoSlot);
+    next_.push_back(kNoSlot);
+  } else {
+    Unlink(slot);
+    seq_index_.erase(seqs_[slot]);
+  }
+
+  auto& addr = addresses_[slot];
+  addr.fill(0);
+  if (node.address.is_v6()) {
+    auto bytes = node.address.to_v6().to_bytes();
+    std::copy(bytes.begin(), bytes.end(), addr.begin());
+    is_v6_[slot] = 1;
+  } else {
+    auto bytes = node.address.to_v4().to_bytes();
+    std::copy(bytes.begin(), bytes.end(), addr.begin());
+    is_v6_[slot] = 0;
+  }
+
+  udp_ports_[slot] = node.udp_port;
+  tcp_ports_[slot] = node.tcp_port;
+  user_data_[slot] = node.user_data;
+  last_seen_[slot] = Now();
+  seqs_[slot] = ++last_seq_;
+  seq_index_.emplace_hint(seq_index_.end(), seqs_[slot], slot);
+
+  LinkBack(slot);
+}
+
+size_t CrawlerStore::Expire(std::chrono::seconds max_age) {
+  auto now = Now();
+  size_t removed = 0;
+
+  while (head_ != kNoSlot && now - last_seen_[head_] > max_age.count()) {
+    Remove(head_);
+    ++removed;
+  }
+
+  return removed;
+}
+
+CrawlerStore::Cursor CrawlerStore::Export(Cursor cursor, size_t limit, std::vector<NodeEntrance>& result) const {
+  uint32_t slot;
+  if (!cursor.seq) {
+    slot = head_;
+  } else if (cursor.slot < ids_.size() && seqs_[cursor.slot] == cursor.seq) {
+    slot = next_[cursor.slot];
+  } else {
+    // last exported node was updated or removed since
+    slot = FirstAfter(cursor.seq);
+  }
+
+  for (; slot != kNoSlot && limit; slot = next_[slot], --limit) {
+    result.push_back(Get(slot));
+    cursor.seq = seqs_[slot];
+    cursor.slot = slot;
+  }
+
+  return cursor;
+}
+
+void CrawlerStore::Closest(const NodeId& target, size_t k, std::vector<NodeEntrance>& result) const {
+  std::vector<uint32_t> slots;
+  index_.Closest(target, k, slots);
+
+  for (auto slot : slots) {
+    result.push_back(Get(slot));
+  }
+}
+
+NodeEntrance CrawlerStore::Get(uint32_t slot) const {
+  NodeEntrance node;
+  node.id = ids_[slot];
+
+  auto& addr = addresses_[slot];
+  if (is_v6_[slot]) {
+    bi::address_v6::bytes_type bytes;
+    std::copy(addr.begin(), addr.end(), bytes.begin());
+    node.address = bi::make_address_v6(bytes);
+  } else {
+    bi::address_v4::bytes_type bytes;
+    std::copy(addr.begin(), addr.begin() + bytes.size(), bytes.begin());
+    node.address = bi::make_address_v4(bytes);
+  }
+
+  node.udp_port = udp_ports_[slot];
+  node.tcp_port = tcp_ports_[slot];
+  node.user_data = user_data_[slot];
+  return node;
+}
+
+uint32_t CrawlerStore::FirstAfter(uint64_t seq) const {
+  auto it = seq_index_.lower_bound(seq + 1);
+  return it != seq_index_.end() ? it->second : kNoSlot;
+}
+
+uint32_t CrawlerStore::Now() const noexcept {
+  return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::seconds>(
+                                 std::chrono::steady_clock::now() - epoch_).count());
+}
+
+void CrawlerStore::LinkBack(uint32_t slot) noexcept {
+  prev_[slot] = tail_;
+  next_[slot] = kNoSlot;
+
+  if (tail_ != kNoSlot) {
+    next_[tail_] = slot;
+  } else {
+    head_ = slot;
+  }
+  tail_ = slot;
+}
+
+void CrawlerStore::Unlink(uint32_t slot) noexcept {
+  if (prev_[slot] != kNoSlot) {
+    next_[prev_[slot]] = next_[slot];
+  } else {
+    head_ = next_[slot];
+  }
+
+  if (next_[slot] != kNoSlot) {
+    prev_[next_[slot]] = prev_[slot];
+  } else {
+    tail_ = prev_[slot];
+  }
+}
+
+void CrawlerStore::Remove(uint32_t slot) {
+  Unlink(slot);
+  index_.Erase(ids_[slot]);
+  seq_index_.erase(seqs_[slot]);
+
+  // keep arrays dense, the last record fills the gap
+  auto last = static_cast<uint32_t>(ids_.size() - 1);
+  if (slot != last) {
+    ids_[slot] = ids_[last];
+    addresses_[slot] = addresses_[last];
+    is_v6_[slot] = is_v6_[last];
+    udp_ports_[slot] = udp_ports_[last];
+    tcp_ports_[slot] = tcp_ports_[last];
+    user_data_[slot] = user_data_[last];
+    last_seen_[slot] = last_seen_[last];
+    seqs_[slot] = seqs_[last];
+    prev_[slot] = prev_[last];
+    next_[slot] = next_[last];
+
+    if (prev_[slot] != kNoSlot) {
+      next_[prev_[slot]] = slot;
+    } else {
+      head_ = slot;
+    }
+
+    if (next_[slot] != kNoSlot) {
+      prev_[next_[slot]] = slot;
+    } else {
+      tail_ = slot;
+    }
+
+    index_.Insert(ids_[slot], slot);
+    seq_index_[seqs_[slot]] = slot;
+  }
+
+  ids_.pop_back();
+  addresses_.pop_back();
+  is_v6_.pop_back();
+  udp_ports_.pop_back();
+  tcp_ports_.pop_back();
+  user_data_.pop_back();
+  last_seen_.pop_back();
+  seqs_.pop_back();
+  prev_.pop_back();
+  next_.pop_back();
+}
+} // namespace net
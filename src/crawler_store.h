@@ -0,0 +1,75 @@
+#ifndef NET_CRAWLER_STORE_H
+#define NET_CRAWLER_STORE_H
+
+#include <array>
+#include <chrono>
+#include <limits>
+#include <map>
+#include <vector>
+
+#include "common.h"
+#include "utils/id_trie.h"
+
+namespace net {
+
+// Nodes collected in full net discovery mode.
+// Records are kept as struct of arrays and linked in order of last update,
+// so aging drops from the list head and export walks it from a cursor.
+// Slots are indexed by id trie, which also answers k closest queries.
+// Not thread safe.
+class CrawlerStore {
+ public:
+  static constexpr uint32_t kNoSlot = std::numeric_limits<uint32_t>::max();
+
+  // Position in export, default one is the beginning.
+  struct Cursor {
+    uint64_t seq = 0;        // update number of the last exported node
+    uint32_t slot = kNoSlot; // its slot, if it has not moved since
+  };
+
+  // adds node or refreshes its contacts and last seen time
+  void Update(const NodeEntrance&);
+  // removes nodes not seen for max_age, returns their number
+  size_t Expire(std::chrono::seconds max_age);
+  size_t Size() const noexcept { return ids_.size(); }
+
+  // Appends at most limit nodes updated after cursor, in order of update,
+  // and returns cursor of the next page. Nodes updated after their export
+  // are returned again, so paging on from the last cursor gives incremental snapshot.
+  Cursor Export(Cursor, size_t limit, std::vector<NodeEntrance>&) const;
+
+  // Appends at most k nodes closest to target, nearest first.
+  void Closest(const NodeId& target, size_t k, std::vector<NodeEntrance>&) const;
+
+ private:
+  NodeEntrance Get(uint32_t slot) const;
+  uint32_t FirstAfter(uint64_t seq) const;
+  uint32_t Now() const noexcept;
+
+  void LinkBack(uint32_t slot) noexcept;
+  void Unlink(uint32_t slot) noexcept;
+  void Remove(uint32_t slot);
+
+  const std::chrono::steady_clock::time_point epoch_ = std::chrono::steady_clock::now();
+
+  IdTrie index_;
+  // resumes export when node at cursor has been updated or removed since
+  std::map<uint64_t, uint32_t> seq_index_;
+
+  std::vector<NodeId> ids_;
+  std::vector<std::array<uint8_t, 16>> addresses_; // v4 takes first 4 bytes
+  std::vector<uint8_t> is_v6_;
+  std::vector<uint16_t> udp_ports_;
+  std::vector<uint16_t> tcp_ports_;
+  std::vector<uint64_t> user_data_;
+  std::vector<uint32_t> last_seen_; // seconds since epoch_
+  std::vector<uint64_t> seqs_;
+  std::vector<uint32_t> prev_;
+  std::vector<uint32_t> next_;
+
+  uint32_t head_ = kNoSlot; // least recently updated
+  uint32_t tail_ = kNoSlot;
+  uint64_t last_seq_ = 0;
+};
+} // namespace net
+#endif // NET_CRAWLER_STORE_H
@@ -1,13 +1,70 @@
 #include "routing_table.h"
 
+#include "utils/log.h"
+
 namespace net {
 
 RoutingTable::FragmentCollector::FragmentCollector(RoutingTable& rt)
     : routing_table_(rt), db_(kDbPath) {
+  MigrateDb();
   lookup_thread_ = std::thread(&RoutingTable::FragmentCollector::LookupRoutine, this);
   replication_thread_ = std::thread(&RoutingTable::FragmentCollector::ReplicationRoutine, this);
 }
 
+namespace {
+constexpr uint8_t kDbVersionKey[] = {'d', 'b', '_', 'v', 'e', 'r', 's', 'i', 'o', 'n'};
+constexpr uint8_t kDbVersion = 1;
+constexpr size_t kMigrationBatchSize = 256;
+
+// Fragment stored before varint length prefixes: native size_t + bytes.
+struct LegacyFragment {
+  ByteVector& data;
+
+  bool Get(Unserializer& u) {
+    size_t size;
+    if (!u.Get(size)) return false;
+    // record already converted by interrupted migration
+    if (size > u.Remaining()) return false;
+    data.resize(size);
+    return u.Get(data.data(), data.size());
+  }
+};
+} // namespace
+
+void RoutingTable::FragmentCollector::MigrateDb() {
+  uint8_t version = 0;
+  try {
+    db_.Read(kDbVersionKey, sizeof(kDbVersionKey), version);
+  } catch (...) {}
+
+  if (version == kDbVersion) return;
+
+  WriteBatch batch;
+  size_t batch_size = 0, migrated = 0, skipped = 0;
+  for (auto it = db_.begin(); it.IsValid(); ++it) {
+    FragmentId id;
+    ByteVector fragment;
+    LegacyFragment legacy{fragment};
+    if (!it.Key(reinterpret_cast<uint8_t*>(id.GetPtr()), id.size()) || !it.Value(legacy)) {
+      ++skipped;
+      continue;
+    }
+
+    batch.Write(reinterpret_cast<const uint8_t*>(id.GetPtr()), id.size(), fragment);
+    if (++batch_size == kMigrationBatchSize) {
+      db_.Write(batch);
+      batch.Clear();
+      batch_size = 0;
+    }
+    ++migrated;
+  }
+
+  batch.Write(kDbVersionKey, sizeof(kDbVersionKey), kDbVersion);
+  db_.Write(batch);
+  LOG(DEBUG) << "Fragments db migrated to version " << static_cast<int>(kDbVersion)
+             << ", fragments " << migrated << ", skipped " << skipped;
+}
+
 void RoutingTable::FragmentCollector::Stop() {
   stop_flag_ = true;
   cv_rep_.notify_one();
@@ -99,8 +156,8 @@ bool RoutingTable::FragmentCollector::StoreFragment(const FragmentId& id, ByteVe
     RemoveFromDb(id);
   }
 
-  routing_table_.SendToSocket(StoreDatagram(routing_table_.host_data_, id, std::move(fragment)),
-                              nearest);
+  routing_table_.SendToHost(StoreDatagram(routing_table_.host_data_, id, std::move(fragment)),
+                            nearest);
   return keep_in_own_db;
 }
 
@@ -125,7 +182,7 @@ bool RoutingTable::FragmentCollector::ExistsInDb(const FragmentId& id, ByteVecto
 void RoutingTable::FragmentCollector::StartFindInNetwork(const FragmentId& id) {
   AddToRequiredNetwork(id);
   routing_table_.SendToSocket(FindFragmentDatagram(routing_table_.host_data_, id),
-                              routing_table_.NearestNodes(id));
+                              routing_table_.NearestNodes(id, true));
   StartLookupTimer(id);
 }
 
@@ -143,23 +200,21 @@ void RoutingTable::FragmentCollector::StartLookupTimer(const FragmentId& id) {
   timer->async_wait(std::move(callback));
 }
 
-void RoutingTable::FragmentCollector::HandleFindFragment(const KademliaDatagram& d) {
-  auto& find_fragment = dynamic_cast<const FindFragmentDatagram&>(d);
+void RoutingTable::FragmentCollector::HandleFindFragment(const FindFragmentDatagram& find_fragment, Socket& socket) {
   ByteVector fragment;
 
   if (ExistsInDb(find_fragment.target, fragment)) {
     FragmentFoundDatagram answer(routing_table_.host_data_, find_fragment.target, std::move(fragment));
-    routing_table_.socket_->Send(answer.ToUdp(d.node_from));
+    routing_table_.host_.SendFragmentDatagram(find_fragment.node_from, EncodeBytes(answer));
     return;
   }
 
   FragmentNotFoundDatagram answer(routing_table_.host_data_, find_fragment.target,
                                   routing_table_.NearestNodes(find_fragment.target));
-  routing_table_.socket_->Send(answer.ToUdp(d.node_from));
+  socket.Send(answer.ToUdp(find_fragment.node_from));
 }
 
-void RoutingTable::FragmentCollector::HandleStoreFragment(const KademliaDatagram& d) {
-  auto& store_datagram = dynamic_cast<const StoreDatagram&>(d);
+void RoutingTable::FragmentCollector::HandleStoreFragment(const StoreDatagram& store_datagram) {
   StoreInDb(store_datagram.id, store_datagram.fragment);
 }
 
@@ -174,16 +229,14 @@ void RoutingTable::FragmentCollector::RemoveFromDb(const FragmentId& id) {
   db_.Remove(reinterpret_cast<const uint8_t*>(id.GetPtr()), id.size());
 }
 
-void RoutingTable::FragmentCollector::HandleFragmentFound(KademliaDatagram& d) {
-  auto& fragment_found_datagram = dynamic_cast<FragmentFoundDatagram&>(d);
+void RoutingTable::FragmentCollector::HandleFragmentFound(FragmentFoundDatagram& fragment_found_datagram) {
   if (RemoveFromRequiredNetwork(fragment_found_datagram.target)) {
     routing_table_.host_.OnFragmentFound(fragment_found_datagram.target,
                                          std::move(fragment_found_datagram.fragment));
   }
 }
 
-void RoutingTable::FragmentCollector::HandleFragmentNotFound(const KademliaDatagram& d) {
-  auto fragment_not_found_datagram = dynamic_cast<const FragmentNotFoundDatagram&>(d);
+void RoutingTable::FragmentCollector::HandleFragmentNotFound(const FragmentNotFoundDatagram& fragment_not_found_datagram) {
   std::vector<NodeEntrance> closest;
 
   {
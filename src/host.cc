@@ -1,6 +1,8 @@
 #include "host.h"
 
+#include <algorithm>
 #include <cmath>
+#include <limits>
 
 #include "utils/log.h"
 
@@ -73,7 +75,7 @@ void Host::GetBanList(std::set<BanEntry>& ret_container) const {
 }
 
 std::vector<FragmentId> Host::StoreValue(ByteVector&& value) {
-  static auto max_size = RoutingTable::GetMaxFragmentSize();
+  auto max_size = routing_table_->GetMaxFragmentSize();
   std::vector<FragmentId> result;
 
   auto num_fragments = static_cast<size_t>(std::ceil(double(value.size()) / max_size));
@@ -101,10 +103,62 @@ void Host::OnFragmentNotFound(const FragmentId& id) {
   event_handler_.OnFragmentNotFound(id);
 }
 
+void Host::SendFragmentDatagram(const NodeEntrance& to, ByteVector&& datagram) {
+  if (to.id == my_id_) return;
+  SendPacket(to, FormPacket(Packet::Type::kFragment, std::move(datagram), to.id));
+}
+
+void Host::FindNode(const NodeId& id, FindNodeCallback callback) {
+  // known contacts are delivered from io thread as well, so caller never
+  // gets callback inline
+  if (id == my_id_) {
+    ba::post(io_, [callback = std::move(callback)] {
+      callback(Network::Instance().GetHostContacts(), {});
+    });
+    return;
+  }
+
+  NodeEntrance contacts;
+  if (GetContacts(id, contacts)) {
+    ba::post(io_, [callback = std::move(callback), contacts] {
+      callback(contacts, {});
+    });
+    return;
+  }
+
+  {
+   Guard g(find_node_mux_);
+   auto& callbacks = find_node_callbacks_[id];
+   callbacks.push_back(std::move(callback));
+   // lookup is already in progress
+   if (callbacks.size() > 1) return;
+  }
+
+  routing_table_->StartFindNode(id);
+}
+
+void Host::OnLookupFinished(const NodeId& target, const std::optional<NodeEntrance>& found,
+                            std::vector<NodeEntrance>&& closest) {
+  std::vector<FindNodeCallback> callbacks;
+  {
+   Guard g(find_node_mux_);
+   auto it = find_node_callbacks_.find(target);
+   if (it == find_node_callbacks_.end()) return;
+   callbacks.swap(it->second);
+   find_node_callbacks_.erase(it);
+  }
+
+  for (auto& c : callbacks) {
+    c(found, closest);
+  }
+}
+
 void Host::OnIdBanned(const NodeId& peer) {
-  DropConnections(peer);
-  ClearSendQueue(peer);
-  RemoveFromPendingConn(peer);
+  {
+   Guard g(contacts_mux_);
+   contact_cache_.Erase(peer);
+  }
+  DropPeer(peer);
 }
 
 void Host::HandleRoutTableEvent(const NodeEntrance& node, RoutingTableEventType event) {
@@ -112,26 +166,43 @@ void Host::HandleRoutTableEvent(const NodeEntrance& node, RoutingTableEventType
     case RoutingTableEventType::kNodeFound : {
       ban_man_->OnNodeFound(node);
 
-      auto conn = IsConnected(node.id);
-      if (!conn) {
-        Connect(node);
-      } else {
-        CheckSendQueue(node.id, conn);
+      {
+       Guard g(contacts_mux_);
+       contact_cache_.Put(node);
       }
+
+      {
+       Guard g(peers_mux_);
+       auto it = peers_.find(node.id);
+       auto conn = it != peers_.end() ? it->second.GetConnection() : nullptr;
+       if (conn) {
+         FlushSendQueue(it->second, conn);
+         break;
+       }
+      }
+
+      Connect(node);
       break;
     }
 
     case RoutingTableEventType::kNodeNotFound :
       ban_man_->OnNodeNotFound(node.id);
       ClearSendQueue(node.id);
-      RemoveFromPendingConn(node.id);
       break;
 
-    case RoutingTableEventType::kNodeAdded :
+    case RoutingTableEventType::kNodeAdded : {
       LOG(DEBUG) << "ROUTING TABLE: add " << IdToBase58(node.id);
-      RemoveFromUnreachable(node.id);
+      {
+       Guard g(peers_mux_);
+       auto it = peers_.find(node.id);
+       if (it != peers_.end()) {
+         it->second.failed_attempts = 0;
+         RemoveIfIdle(it);
+       }
+      }
       event_handler_.OnNodeDiscovered(node.id);
       break;
+    }
 
     case RoutingTableEventType::kNodeRemoved :
       LOG(DEBUG) << "ROUTING TABLE: remove " << IdToBase58(node.id);
@@ -144,10 +215,16 @@ bool Host::IsEndpointBanned(const bi::address& addr, uint16_t port) {
   return ban_man_->IsBanned(BanEntry{addr, port});
 }
 
-void Host::OnPacketReceived(Packet&& packet) {
+void Host::OnPacketReceived(const NodeId& remote_node, Packet&& packet) {
+  // sender field is not trusted, only the connected peer is known to be alive
   if (packet.IsDirect() && packet.header.receiver == my_id_) {
+    routing_table_->OnNodeSeen(remote_node);
     event_handler_.OnMessageReceived(packet.header.sender, std::move(packet.data));
+  } else if (packet.IsFragment() && packet.header.receiver == my_id_) {
+    routing_table_->OnNodeSeen(remote_node);
+    routing_table_->OnFragmentDatagram(remote_node, ByteView(packet.data.data(), packet.data.size()));
   } else if (packet.IsBroadcast() && !IsDuplicate(packet)) {
+    routing_table_->OnNodeSeen(remote_node);
     auto nodes = routing_table_->GetBroadcastList(packet.header.receiver);
     packet.header.receiver = my_id_;
     for (const auto& n : nodes) {
@@ -187,11 +264,28 @@ void Host::SendDirect(const NodeId& receiver, ByteVector&& data) {
 
   auto pack = FormPacket(Packet::Type::kDirect, std::move(data), receiver);
 
+  {
+   Guard g(peers_mux_);
+   auto it = peers_.find(receiver);
+   if (it != peers_.end()) {
+     auto& peer = it->second;
+     auto conn = peer.GetSendConnection();
+     if (conn) {
+       ++peer.packets_sent;
+       conn->Send(std::move(pack));
+       return;
+     }
+   }
+  }
+
   NodeEntrance receiver_contacts;
-  if (routing_table_->HasNode(receiver, receiver_contacts)) {
+  if (GetContacts(receiver, receiver_contacts)) {
     SendPacket(receiver_contacts, std::move(pack));
   } else {
-    AddToSendQueue(receiver, std::move(pack));
+    {
+     Guard g(peers_mux_);
+     PushToSendQueue(peers_[receiver], std::move(pack));
+    }
     routing_table_->StartFindNode(receiver);
   }
 }
@@ -201,6 +295,13 @@ void Host::SendDirect(const NodeEntrance& receiver, const Packet& packet) {
   SendPacket(receiver, std::move(copy));
 }
 
+bool Host::GetContacts(const NodeId& id, NodeEntrance& contacts) {
+  if (routing_table_->HasNode(id, contacts)) return true;
+
+  Guard g(contacts_mux_);
+  return contact_cache_.Get(id, contacts);
+}
+
 void Host::SendBroadcast(ByteVector&& data) {
   auto pack = FormPacket(Packet::Type::kBroadcast, std::move(data), my_id_);
   InsertNewBroadcast(pack);
@@ -224,7 +325,7 @@ void Host::SendBroadcastIfNoConnection(const NodeId& receiver, ByteVector&& data
   SendBroadcast(std::move(data));
 
   NodeEntrance receiver_contacts;
-  if (!routing_table_->HasNode(receiver, receiver_contacts)) {
+  if (!GetContacts(receiver, receiver_contacts)) {
     routing_table_->StartFindNode(receiver);
   } else {
     Connect(receiver_contacts);
@@ -237,7 +338,7 @@ Packet Host::FormPacket(Packet::Type type, ByteVector&& data, const NodeId& rece
 
   auto& h = result.header;
   h.type = type;
-  h.data_size = result.data.size();
+  h.data_size = static_cast<uint32_t>(result.data.size());
   h.sender = my_id_;
   h.receiver = receiver;
 
@@ -245,46 +346,78 @@ Packet Host::FormPacket(Packet::Type type, ByteVector&& data, const NodeId& rece
 }
 
 void Host::SendPacket(const NodeEntrance& receiver, Packet&& pack) {
-  auto conn = IsConnected(receiver.id);
-  if (conn) {
-    conn->Send(std::move(pack));
+  if (IsEndpointBanned(receiver.address, receiver.tcp_port)) {
+    DropPeer(receiver.id);
     return;
   }
 
-  AddToSendQueue(receiver.id, std::move(pack));
-  Connect(receiver);
+  {
+   Guard g(peers_mux_);
+   auto it = peers_.try_emplace(receiver.id).first;
+   auto& peer = it->second;
+
+   auto conn = peer.GetSendConnection();
+   if (conn) {
+     ++peer.packets_sent;
+     conn->Send(std::move(pack));
+     return;
+   }
+
+   if (peer.IsUnreachable(std::chrono::steady_clock::now())) {
+     ClearSendQueue(peer);
+     ++peer.packets_dropped;
+     return;
+   }
+
+   PushToSendQueue(peer, std::move(pack));
+   StartConnection(receiver, peer);
+  }
 }
 
-Connection::Ptr Host::IsConnected(const NodeId& peer) {
-  Guard g(conn_mux_);
-  auto it = connections_.find(peer);
-  if (it != connections_.end()) {
-    return it->second;
+Connection::Ptr Host::IsConnected(const NodeId& id) {
+  Guard g(peers_mux_);
+  auto it = peers_.find(id);
+  if (it != peers_.end()) {
+    return it->second.GetConnection();
   }
   return nullptr;
 }
 
-void Host::Connect(const NodeEntrance& peer) {
-  if (IsEndpointBanned(peer.address, peer.tcp_port)) {
-    ClearSendQueue(peer.id);
-    RemoveFromPendingConn(peer.id);
+void Host::Connect(const NodeEntrance& node) {
+  if (IsEndpointBanned(node.address, node.tcp_port)) {
+    DropPeer(node.id);
     return;
   }
 
-  if (IsUnreachable(peer.id)) {
-    ClearSendQueue(peer.id);
-    return;
-  }
+  {
+   Guard g(peers_mux_);
+   auto it = peers_.try_emplace(node.id).first;
+   auto& peer = it->second;
 
-  if (HasPendingConnection(peer.id)) {
-    return;
+   if (peer.IsUnreachable(std::chrono::steady_clock::now())) {
+     ClearSendQueue(peer);
+     return;
+   }
+
+   if (peer.pending_connection || !peer.connections.empty()) {
+     return;
+   }
+
+   StartConnection(node, peer);
   }
+}
 
-  auto new_conn = Connection::Create(static_cast<ConnectionOwner&>(*this), io_);
-  new_conn->Connect(Connection::Endpoint(peer.address, peer.tcp_port),
-                    FormPacket(Packet::Type::kRegistration,
-                               Network::Instance().GetRegistrationData(),
-                               peer.id));
+void Host::StartConnection(const NodeEntrance& node, PeerState& peer) {
+  ++peer.connect_attempts;
+
+  peer.pending_connection = Connection::Create(static_cast<ConnectionOwner&>(*this), io_);
+  peer.pending_connection->Connect(Connection::Endpoint(node.address, node.tcp_port),
+                                   FormPacket(Packet::Type::kRegistration,
+                                              Network::Instance().GetRegistrationData(),
+                                              node.id));
+
+  // don't wait for remote registration, queued data goes right after our own
+  FlushSendQueue(peer, peer.pending_connection);
 }
 
 void Host::AddKnownNodes(const std::vector<NodeEntrance>& nodes) {
@@ -295,6 +428,10 @@ void Host::GetKnownNodes(std::vector<NodeEntrance>& nodes) {
   routing_table_->GetKnownNodes(nodes);
 }
 
+CrawlerStore::Cursor Host::GetKnownNodes(CrawlerStore::Cursor cursor, size_t limit, std::vector<NodeEntrance>& nodes) {
+  return routing_table_->GetKnownNodes(cursor, limit, nodes);
+}
+
 void Host::TcpListen() {
   auto& contacts = Network::Instance().GetHostContacts();
 
@@ -354,143 +491,184 @@ void Host::StartAccept() {
   }
 }
 
-void Host::OnConnected(Packet&& conn_pack, Connection::Ptr new_conn) {
+bool Host::OnConnected(Packet&& conn_pack, Connection::Ptr new_conn) {
   const auto& remote_node = conn_pack.header.sender;
 
-  Guard g(conn_mux_);
-  connections_.insert(std::make_pair(remote_node, new_conn));
+  if (!new_conn->IsActive() && conn_pack.header.receiver != my_id_) {
+    // data pipelined after registration is addressed to another node
+    LOG(DEBUG) << "Registration for unknown receiver from " << IdToBase58(remote_node);
+    return false;
+  }
 
-  if (!new_conn->IsActive()) {
-    new_conn->Send(FormPacket(Packet::Type::kRegistration,
-                              Network::Instance().GetRegistrationData(),
-                              remote_node));
-    LOG(DEBUG) << "New passive connection with " << IdToBase58(remote_node);
-  } else {
-    LOG(DEBUG) << "New active connection with " << IdToBase58(remote_node);
-    RemoveFromPendingConn(remote_node);
+  {
+   Guard g(peers_mux_);
+   auto& peer = peers_[remote_node];
+   peer.connections.push_back(new_conn);
+   peer.failed_attempts = 0;
+
+   if (!new_conn->IsActive()) {
+     new_conn->Send(FormPacket(Packet::Type::kRegistration,
+                               Network::Instance().GetRegistrationData(),
+                               remote_node));
+     LOG(DEBUG) << "New passive connection with " << IdToBase58(remote_node);
+   } else {
+     LOG(DEBUG) << "New active connection with " << IdToBase58(remote_node);
+     peer.pending_connection.reset();
+   }
+
+   FlushSendQueue(peer, new_conn);
+  }
+
+  NodeEntrance remote_contacts;
+  if (!new_conn->IsActive() && Network::GetRemoteContacts(conn_pack, new_conn, remote_contacts)) {
+    Guard g(contacts_mux_);
+    contact_cache_.Put(remote_contacts);
   }
 
-  CheckSendQueue(remote_node, new_conn);
   Network::Instance().OnConnected(std::move(conn_pack), new_conn);
+  return true;
 }
 
 void Host::OnConnectionDropped(const NodeId& remote_node, bool active,
                                Connection::DropReason drop_reason) {
-  Guard g(conn_mux_);
-  auto range = connections_.equal_range(remote_node);
-  for (auto it = range.first; it != range.second;) {
-    if (it->second->IsActive() == active) {
-      it = connections_.erase(it);
-      LOG(DEBUG) << "Connection with " << IdToBase58(remote_node)
-                << " was closed, active: " << active << ". Reason: "
-                << Connection::DropReasonToString(drop_reason);
-    } else {
-      ++it;
-    }
+  {
+   Guard g(peers_mux_);
+   auto it = peers_.find(remote_node);
+   if (it != peers_.end()) {
+     auto& peer = it->second;
+     auto& conns = peer.connections;
+     auto removed = std::remove_if(conns.begin(), conns.end(),
+                      [active](const Connection::Ptr& c) { return c->IsActive() == active; });
+
+     if (removed != conns.end()) {
+       LOG(DEBUG) << "Connection with " << IdToBase58(remote_node)
+                  << " was closed, active: " << active << ". Reason: "
+                  << Connection::DropReasonToString(drop_reason)
+                  << " Packets sent: " << peer.packets_sent
+                  << ", dropped: " << peer.packets_dropped;
+       conns.erase(removed, conns.end());
+     }
+
+     if (conns.empty()) {
+       ClearSendQueue(peer);
+     }
+     RemoveIfIdle(it);
+   }
   }
 
-  if (!connections_.count(remote_node)) {
-    ClearSendQueue(remote_node);
-  }
   Network::Instance().OnConnectionDropped(remote_node, active);
 }
 
-void Host::AddToSendQueue(const NodeId& id, Packet&& pack) {
-   Guard g(send_mux_);
+void Host::OnPendingConnectionError(const NodeId& id, Connection::DropReason drop_reason) {
+  LOG(DEBUG) << "Pending connection with " << IdToBase58(id)
+            << " was closed, reason " << Connection::DropReasonToString(drop_reason);
 
-   if (packets_to_send_ == kMaxSendQueueSize_) {
-     auto it = send_queue_.begin();
-     packets_to_send_ -= it->second.size();
-     send_queue_.erase(it);
-   }
+  Guard g(peers_mux_);
+  auto it = peers_.find(id);
+  if (it == peers_.end()) return;
 
-   send_queue_[id].emplace_back(std::move(pack));
-   ++packets_to_send_;
-}
+  auto& peer = it->second;
+  peer.pending_connection.reset();
+  ClearSendQueue(peer);
 
-void Host::ClearSendQueue(const NodeId& id) {
-  Guard g(send_mux_);
-  auto it = send_queue_.find(id);
-  if (it != send_queue_.end()) {
-    packets_to_send_ -= it->second.size();
-    send_queue_.erase(it);
+  if (drop_reason == Connection::DropReason::kConnectionError || drop_reason == Connection::DropReason::kTimeout) {
+    {
+     // cached contacts may be outdated, next send will start lookup
+     Guard cg(contacts_mux_);
+     contact_cache_.Erase(id);
+    }
+    SetUnreachable(peer);
+    LOG(DEBUG) << IdToBase58(id) << " is unreachable, failed attempts " << static_cast<int>(peer.failed_attempts)
+               << " of " << peer.connect_attempts << ", packets dropped " << peer.packets_dropped;
+    RemoveIdlePeers();
+  } else {
+    RemoveIfIdle(it);
   }
 }
 
-void Host::CheckSendQueue(const NodeId& id, Connection::Ptr conn) {
-  Guard g(send_mux_);
-  auto it = send_queue_.find(id);
-  if (it != send_queue_.end()) {
-    packets_to_send_ -= it->second.size();
-    for (auto& p : it->second) {
-      conn->Send(std::move(p));
+void Host::PushToSendQueue(PeerState& peer, Packet&& pack) {
+  if (packets_to_send_ == kMaxSendQueueSize_) {
+    auto it = std::find_if(peers_.begin(), peers_.end(),
+                [](const auto& p) { return !p.second.send_queue.empty(); });
+    if (it != peers_.end()) {
+      ClearSendQueue(it->second);
     }
-    send_queue_.erase(it);
   }
+
+  peer.send_queue.emplace_back(std::move(pack));
+  ++packets_to_send_;
 }
 
-void Host::OnPendingConnectionError(const NodeId& id, Connection::DropReason drop_reason) {
-  LOG(DEBUG) << "Pending connection with " << IdToBase58(id)
-            << " was closed, reason " << Connection::DropReasonToString(drop_reason);
+void Host::ClearSendQueue(PeerState& peer) {
+  packets_to_send_ -= peer.send_queue.size();
+  peer.packets_dropped += peer.send_queue.size();
+  peer.send_queue.clear();
+}
 
-  if (drop_reason == Connection::DropReason::kConnectionError || drop_reason == Connection::DropReason::kTimeout) {
-    AddToUnreachable(id);
+void Host::FlushSendQueue(PeerState& peer, Connection::Ptr conn) {
+  packets_to_send_ -= peer.send_queue.size();
+  peer.packets_sent += peer.send_queue.size();
+  for (auto& p : peer.send_queue) {
+    conn->Send(std::move(p));
   }
-
-  ClearSendQueue(id);
-  RemoveFromPendingConn(id);
+  peer.send_queue.clear();
 }
 
-void Host::RemoveFromPendingConn(const NodeId& id) {
-  Guard g(pend_conn_mux_);
-  pending_connections_.erase(id);
-}
+void Host::SetUnreachable(PeerState& peer) {
+  using namespace std::chrono;
 
-bool Host::HasPendingConnection(const NodeId& id) {
-  Guard g(pend_conn_mux_);
-  if (pending_connections_.find(id) != pending_connections_.end()) {
-    return true;
+  if (peer.failed_attempts < std::numeric_limits<uint8_t>::max()) {
+    ++peer.failed_attempts;
   }
-  pending_connections_.insert(id);
-  return false;
-}
 
-void Host::DropConnections(const NodeId& id) {
-  Guard g(conn_mux_);
-  auto range = connections_.equal_range(id);
-  for (auto it = range.first; it != range.second;) {
-    it->second->Close();
-    it = connections_.erase(it);
-    LOG(DEBUG) << "Manualy drop connection with " << IdToBase58(id);
+  auto backoff = kMinSecondsInUnreachablePool_;
+  for (uint8_t i = 1; i < peer.failed_attempts && backoff < kMaxSecondsInUnreachablePool_; ++i) {
+    backoff *= 2;
   }
+  peer.unreachable_until = steady_clock::now() + std::min(backoff, kMaxSecondsInUnreachablePool_);
 }
 
-bool Host::IsUnreachable(const NodeId& peer) {
-  Guard g(unreachable_mux_);
-
-  using namespace std::chrono;
-  auto now = steady_clock::now();
-
-  for (auto it = unreachable_peers_.begin(); it != unreachable_peers_.end();) {
-    auto seconds_unreachable = duration_cast<seconds>(now - it->second);
+void Host::RemoveIfIdle(Peers::iterator it) {
+  if (it->second.IsIdle(std::chrono::steady_clock::now())) {
+    peers_.erase(it);
+  }
+}
 
-    if (seconds_unreachable >= kMaxSecondsInUnreachablePool_) {
-      it = unreachable_peers_.erase(it);
+void Host::RemoveIdlePeers() {
+  auto now = std::chrono::steady_clock::now();
+  for (auto it = peers_.begin(); it != peers_.end();) {
+    if (it->second.IsIdle(now)) {
+      it = peers_.erase(it);
     } else {
       ++it;
     }
   }
-
-  return unreachable_peers_.find(peer) != unreachable_peers_.end();
 }
 
-void Host::AddToUnreachable(const NodeId& peer) {
-  Guard g(unreachable_mux_);
-  unreachable_peers_[peer] = std::chrono::steady_clock::now();
+void Host::ClearSendQueue(const NodeId& id) {
+  Guard g(peers_mux_);
+  auto it = peers_.find(id);
+  if (it != peers_.end()) {
+    ClearSendQueue(it->second);
+    RemoveIfIdle(it);
+  }
 }
 
-void Host::RemoveFromUnreachable(const NodeId& peer) {
-  Guard g(unreachable_mux_);
-  unreachable_peers_.erase(peer);
+void Host::DropPeer(const NodeId& id) {
+  Guard g(peers_mux_);
+  auto it = peers_.find(id);
+  if (it == peers_.end()) return;
+
+  for (auto& conn : it->second.connections) {
+    conn->Close();
+    LOG(DEBUG) << "Manualy drop connection with " << IdToBase58(id);
+  }
+
+  if (it->second.pending_connection) {
+    it->second.pending_connection->Close();
+  }
+
+  ClearSendQueue(it->second);
+  peers_.erase(it);
 }
 } // namespace net
@@ -2,7 +2,9 @@
 #define NET_HOST_H
 
 #include <chrono>
+#include <functional>
 #include <memory>
+#include <optional>
 #include <unordered_map>
 #include <unordered_set>
 #include <thread>
@@ -11,6 +13,7 @@
 #include "banman.h"
 #include "common.h"
 #include "connection.h"
+#include "contact_cache.h"
 #include "network.h"
 #include "routing_table.h"
 
@@ -27,8 +30,17 @@ class Host : public RoutingTableEventHandler, public BanManOwner, public Connect
   void SendBroadcast(ByteVector&& msg);
   void SendBroadcastIfNoConnection(const NodeId& to, ByteVector&& msg);
 
+  // found is empty if node was not resolved, closest is partial lookup result
+  using FindNodeCallback = std::function<void(const std::optional<NodeEntrance>& found,
+                                              const std::vector<NodeEntrance>& closest)>;
+  // Resolves contacts from routing table, contact cache or by lookup,
+  // concurrent requests for the same id share one lookup.
+  // Callback is always called from io thread.
+  void FindNode(const NodeId&, FindNodeCallback);
+
   void AddKnownNodes(const std::vector<NodeEntrance>&);
   void GetKnownNodes(std::vector<NodeEntrance>&);
+  CrawlerStore::Cursor GetKnownNodes(CrawlerStore::Cursor, size_t limit, std::vector<NodeEntrance>&);
 
   void Ban(const NodeId&);
   void Unban(const NodeId&);
@@ -44,14 +56,17 @@ class Host : public RoutingTableEventHandler, public BanManOwner, public Connect
   bool IsEndpointBanned(const bi::address& addr, uint16_t port) override;
   void OnFragmentFound(const FragmentId&, ByteVector&&) override;
   void OnFragmentNotFound(const FragmentId&) override;
+  void SendFragmentDatagram(const NodeEntrance&, ByteVector&&) override;
+  void OnLookupFinished(const NodeId& target, const std::optional<NodeEntrance>& found,
+                        std::vector<NodeEntrance>&& closest) override;
 
   // BanManOwner
   void OnIdBanned(const NodeId&) override;
   void OnIdUnbanned(const NodeId&) override {}
 
   // ConnectionOwner
-  void OnPacketReceived(Packet&&) override;
-  void OnConnected(Packet&& conn_pack, Connection::Ptr) override;
+  void OnPacketReceived(const NodeId& remote_node, Packet&&) override;
+  bool OnConnected(Packet&& conn_pack, Connection::Ptr) override;
   void OnConnectionDropped(const NodeId& remote_node, bool active, Connection::DropReason) override;
   void OnPendingConnectionError(const NodeId&, Connection::DropReason) override;
 
@@ -60,6 +75,8 @@ class Host : public RoutingTableEventHandler, public BanManOwner, public Connect
   void StartAccept();
 
   void SendDirect(const NodeEntrance&, const Packet&);
+  // looks in routing table and then in contact cache
+  bool GetContacts(const NodeId&, NodeEntrance&);
   bool IsDuplicate(const Packet&);
   void InsertNewBroadcast(const Packet&);
   void InsertNewBroadcastId(const Packet::Id& id); // doesn't lock broadcast_id_mux_
@@ -67,20 +84,58 @@ class Host : public RoutingTableEventHandler, public BanManOwner, public Connect
   Packet FormPacket(Packet::Type, ByteVector&&, const NodeId& receiver);
   void SendPacket(const NodeEntrance& receiver, Packet&&);
 
+  struct PeerState {
+    std::vector<Connection::Ptr> connections; // active and/or passive
+    std::vector<Packet> send_queue;           // waits for lookup result
+
+    // Active connection which has not passed registration yet.
+    // Packets are pipelined into it right after registration frame.
+    Connection::Ptr pending_connection;
+
+    // exponential backoff after failed connection attempts
+    uint8_t failed_attempts = 0;
+    std::chrono::steady_clock::time_point unreachable_until;
+
+    // stats
+    uint64_t packets_sent = 0;
+    uint64_t packets_dropped = 0;
+    uint64_t connect_attempts = 0;
+
+    Connection::Ptr GetConnection() const noexcept {
+      return connections.empty() ? nullptr : connections.front();
+    }
+
+    Connection::Ptr GetSendConnection() const noexcept {
+      return connections.empty() ? pending_connection : connections.front();
+    }
+
+    bool IsUnreachable(std::chrono::steady_clock::time_point now) const noexcept {
+      return failed_attempts && now < unreachable_until;
+    }
+
+    // failed peer is kept to grow its backoff until success or decay
+    bool IsIdle(std::chrono::steady_clock::time_point now) const noexcept {
+      return connections.empty() && send_queue.empty() && !pending_connection &&
+             (!failed_attempts || now >= unreachable_until + kFailuresDecay_);
+    }
+  };
+
+  using Peers = std::unordered_map<NodeId, PeerState>;
+
   void Connect(const NodeEntrance&);
   Connection::Ptr IsConnected(const NodeId&);
 
-  void RemoveFromPendingConn(const NodeId&);
-  bool HasPendingConnection(const NodeId&);
+  // all methods below don't lock peers_mux_
+  void StartConnection(const NodeEntrance&, PeerState&);
+  void PushToSendQueue(PeerState&, Packet&&);
+  void ClearSendQueue(PeerState&);
+  void FlushSendQueue(PeerState&, Connection::Ptr);
+  void SetUnreachable(PeerState&);
+  void RemoveIfIdle(Peers::iterator);
+  void RemoveIdlePeers();
 
-  void AddToSendQueue(const NodeId&, Packet&&);
   void ClearSendQueue(const NodeId&);
-  void CheckSendQueue(const NodeId&, Connection::Ptr);
-  void DropConnections(const NodeId&);
-
-  bool IsUnreachable(const NodeId&);
-  void AddToUnreachable(const NodeId&);
-  void RemoveFromUnreachable(const NodeId&);
+  void DropPeer(const NodeId&);
 
   ba::io_context io_;
   bi::tcp::acceptor acceptor_;
@@ -92,22 +147,29 @@ class Host : public RoutingTableEventHandler, public BanManOwner, public Connect
   constexpr static size_t kMaxBroadcastIds_ = 10000;
   std::unordered_set<Packet::Id> broadcast_ids_;
 
-  Mutex send_mux_;
-  constexpr static size_t kMaxSendQueueSize_ = 1000;
-  size_t packets_to_send_;
-  std::unordered_map<NodeId, std::vector<Packet>> send_queue_;
-
   std::thread working_thread_;
 
-  Mutex conn_mux_;
-  std::unordered_multimap<NodeId, Connection::Ptr> connections_;
+  // peers resolved by lookups or connected to us, which are out of routing table
+  Mutex contacts_mux_;
+  constexpr static size_t kContactCacheSize_ = 1024;
+  constexpr static std::chrono::seconds kContactCacheTtl_{600};
+  ContactCache contact_cache_{kContactCacheSize_, kContactCacheTtl_};
 
-  Mutex pend_conn_mux_;
-  std::unordered_set<NodeId> pending_connections_;
+  // callbacks of FindNode waiting for lookup result
+  Mutex find_node_mux_;
+  std::unordered_map<NodeId, std::vector<FindNodeCallback>> find_node_callbacks_;
+
+  // connection, send queue, connect state and backoff of each peer,
+  // so that the send path needs a single lookup
+  Mutex peers_mux_;
+  Peers peers_;
+
+  constexpr static size_t kMaxSendQueueSize_ = 1000;
+  size_t packets_to_send_;
 
-  Mutex unreachable_mux_;
+  constexpr static std::chrono::seconds kMinSecondsInUnreachablePool_{15};
   constexpr static std::chrono::seconds kMaxSecondsInUnreachablePool_{120};
-  std::unordered_map<NodeId, std::chrono::steady_clock::time_point> unreachable_peers_;
+  constexpr static std::chrono::seconds kFailuresDecay_{10 * 60};
 
   std::unique_ptr<BanMan> ban_man_ = nullptr;
 };
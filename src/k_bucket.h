@@ -2,88 +2,257 @@
 #define NET_K_BUCKET_H
 
 #include <algorithm>
-#include <list>
+#include <array>
+#include <chrono>
+#include <limits>
+#include <vector>
 
 #include "common.h"
 #include "utils/log.h"
 
 namespace net {
 
+// Fixed capacity bucket without heap allocations.
+// Ids are kept apart from contacts, so lookups scan one contiguous array,
+// recently seen order is kept as array of slot indices.
 class KBucket {
  public:
-  void AddNode(const NodeEntrance&);
+  static constexpr size_t kCapacity = 16;
+  static constexpr size_t kReplacementsCapacity = 8;
+
+  // Liveness of node, it is persisted with routing table.
+  struct NodeInfo {
+    std::chrono::system_clock::time_point last_seen = std::chrono::system_clock::now();
+    uint32_t rtt_ms = 0; // smoothed, 0 - not measured yet
+
+    // for ordering by latency, unmeasured nodes are the slowest
+    uint32_t RttKey() const noexcept { return rtt_ms ? rtt_ms : std::numeric_limits<uint32_t>::max(); }
+  };
+
+  // returns false if bucket is full
+  bool AddNode(const NodeEntrance&);
+  bool AddNode(const NodeEntrance&, const NodeInfo&);
   bool Exists(const NodeId&) const noexcept;
   bool Get(const NodeId&, NodeEntrance&) const noexcept;
+  bool GetInfo(const NodeId&, NodeInfo&) const noexcept;
   size_t Size() const noexcept;
+  bool Full() const noexcept;
 
   void Update(const NodeEntrance&);
+  // rtt_ms is smoothed like tcp srtt: 7/8 of old estimate and 1/8 of sample
+  void AddRttSample(const NodeId&, uint32_t rtt_ms);
 
+  // moves node to most recently seen
   void Promote(const NodeId&);
   void Evict(const NodeId&);
 
   NodeEntrance LeastRecentlySeen() const noexcept;
 
-  const auto& GetNodes() const noexcept {
-    return nodes_;
+  // Node to check before eviction: the slowest one among nodes not seen since idle_since,
+  // least recently seen one on ties. Returns false if all nodes were seen recently.
+  bool EvictionCandidate(std::chrono::system_clock::time_point idle_since, NodeEntrance&) const noexcept;
+
+  // Appends at most n nodes with the lowest rtt.
+  void FastestNodes(size_t n, std::vector<NodeEntrance>&) const;
+
+  // Replacement cache holds nodes seen while bucket was full,
+  // the oldest one is dropped on overflow.
+  void AddReplacement(const NodeEntrance&);
+  // takes the most recently seen replacement
+  bool PopReplacement(NodeEntrance&);
+  size_t ReplacementsSize() const noexcept { return replacements_size_; }
+
+  // Slots [0, Size()) in no particular order, for batched distance kernels.
+  const NodeId* Ids() const noexcept { return ids_.data(); }
+  const NodeEntrance& Contact(size_t slot) const noexcept { return contacts_[slot]; }
+
+  // Calls f for each node from least to most recently seen.
+  template<class F>
+  void ForEach(F f) const {
+    for (uint8_t i = 0; i < size_; ++i) {
+      f(contacts_[order_[i]]);
+    }
+  }
+
+  // Same with f(const NodeEntrance&, const NodeInfo&).
+  template<class F>
+  void ForEachWithInfo(F f) const {
+    for (uint8_t i = 0; i < size_; ++i) {
+      f(contacts_[order_[i]], info_[order_[i]]);
+    }
   }
 
  private:
-  auto FindNode(const NodeId& id) const noexcept {
-    return std::find_if(nodes_.cbegin(), nodes_.cend(),
-                [&id](const NodeEntrance& e) { return e.id == id; });
+  static constexpr uint8_t kNoSlot = kCapacity;
+
+  uint8_t FindSlot(const NodeId& id) const noexcept {
+    for (uint8_t i = 0; i < size_; ++i) {
+      if (ids_[i] == id) return i;
+    }
+    return kNoSlot;
   }
 
-  std::list<NodeEntrance> nodes_;
+  uint8_t FindOrderPos(uint8_t slot) const noexcept {
+    return static_cast<uint8_t>(std::find(order_.cbegin(), order_.cbegin() + size_, slot) -
+                                order_.cbegin());
+  }
+
+  std::array<NodeId, kCapacity> ids_;
+  std::array<NodeEntrance, kCapacity> contacts_;
+  std::array<NodeInfo, kCapacity> info_;
+  std::array<uint8_t, kCapacity> order_; // slots, least recently seen first
+  uint8_t size_ = 0;
+
+  std::array<NodeEntrance, kReplacementsCapacity> replacements_; // oldest first
+  uint8_t replacements_size_ = 0;
 };
 
-inline void KBucket::AddNode(const NodeEntrance& node) {
-  nodes_.push_back(node);
+inline bool KBucket::AddNode(const NodeEntrance& node) {
+  return AddNode(node, NodeInfo());
+}
+
+inline bool KBucket::AddNode(const NodeEntrance& node, const NodeInfo& info) {
+  if (Full()) return false;
+
+  ids_[size_] = node.id;
+  contacts_[size_] = node;
+  info_[size_] = info;
+  order_[size_] = size_;
+  ++size_;
+  return true;
 }
 
 inline bool KBucket::Exists(const NodeId& id) const noexcept {
-  return FindNode(id) != nodes_.cend();
+  return FindSlot(id) != kNoSlot;
 }
 
 inline bool KBucket::Get(const NodeId& id, NodeEntrance& ent) const noexcept {
-  auto it = FindNode(id);
-  if (it != nodes_.cend()) {
-    ent = *it;
+  auto slot = FindSlot(id);
+  if (slot != kNoSlot) {
+    ent = contacts_[slot];
+    return true;
+  }
+  return false;
+}
+
+inline bool KBucket::GetInfo(const NodeId& id, NodeInfo& info) const noexcept {
+  auto slot = FindSlot(id);
+  if (slot != kNoSlot) {
+    info = info_[slot];
     return true;
   }
   return false;
 }
 
 inline size_t KBucket::Size() const noexcept {
-  return nodes_.size();
+  return size_;
+}
+
+inline bool KBucket::Full() const noexcept {
+  return size_ == kCapacity;
 }
 
 inline void KBucket::Update(const NodeEntrance& new_contacts) {
-  auto it = std::find_if(nodes_.begin(), nodes_.end(),
-                [&new_contacts](const NodeEntrance& e) { return e.id == new_contacts.id; });
-  if (it == nodes_.end()) return;
-  *it = new_contacts;
+  auto slot = FindSlot(new_contacts.id);
+  if (slot == kNoSlot) return;
+  contacts_[slot] = new_contacts;
+}
+
+inline void KBucket::AddRttSample(const NodeId& id, uint32_t rtt_ms) {
+  auto slot = FindSlot(id);
+  if (slot == kNoSlot) return;
+
+  auto& srtt = info_[slot].rtt_ms;
+  srtt = srtt ? static_cast<uint32_t>((7ull * srtt + rtt_ms) / 8) : rtt_ms;
+  if (!srtt) srtt = 1;
 }
 
 inline void KBucket::Promote(const NodeId& id) {
-  auto it = FindNode(id);
-  if (it != nodes_.end()) {
-    auto node = *it;
-    nodes_.erase(it);
-    nodes_.push_back(node);
-  }
+  auto slot = FindSlot(id);
+  if (slot == kNoSlot) return;
+
+  info_[slot].last_seen = std::chrono::system_clock::now();
+
+  auto pos = FindOrderPos(slot);
+  std::rotate(order_.begin() + pos, order_.begin() + pos + 1, order_.begin() + size_);
 }
 
 inline void KBucket::Evict(const NodeId& id) {
-  auto it = FindNode(id);
-  if (it != nodes_.end()) nodes_.erase(it);
+  auto slot = FindSlot(id);
+  if (slot == kNoSlot) return;
+
+  auto pos = FindOrderPos(slot);
+  std::copy(order_.begin() + pos + 1, order_.begin() + size_, order_.begin() + pos);
+  --size_;
+
+  // keep slots dense, last one fills the gap
+  if (slot != size_) {
+    ids_[slot] = ids_[size_];
+    contacts_[slot] = contacts_[size_];
+    info_[slot] = info_[size_];
+    order_[FindOrderPos(size_)] = slot;
+  }
 }
 
 inline NodeEntrance KBucket::LeastRecentlySeen() const noexcept {
-  if (!nodes_.size()) {
+  if (!size_) {
     LOG(ERROR) << "Try to get node from empty k-bucket";
     return NodeEntrance();
   }
-  return nodes_.front();
+  return contacts_[order_[0]];
+}
+
+inline bool KBucket::EvictionCandidate(std::chrono::system_clock::time_point idle_since,
+                                       NodeEntrance& node) const noexcept {
+  uint8_t candidate = kNoSlot;
+  for (uint8_t i = 0; i < size_; ++i) {
+    auto slot = order_[i];
+    if (info_[slot].last_seen > idle_since) continue;
+
+    if (candidate == kNoSlot || info_[slot].RttKey() > info_[candidate].RttKey()) {
+      candidate = slot;
+    }
+  }
+
+  if (candidate == kNoSlot) return false;
+  node = contacts_[candidate];
+  return true;
+}
+
+inline void KBucket::FastestNodes(size_t n, std::vector<NodeEntrance>& result) const {
+  std::array<uint8_t, kCapacity> slots;
+  std::copy(order_.cbegin(), order_.cbegin() + size_, slots.begin());
+
+  // stable keeps least recently seen first on ties, as before
+  n = std::min<size_t>(n, size_);
+  std::stable_sort(slots.begin(), slots.begin() + size_,
+                   [this](uint8_t l, uint8_t r) { return info_[l].RttKey() < info_[r].RttKey(); });
+
+  for (size_t i = 0; i < n; ++i) {
+    result.push_back(contacts_[slots[i]]);
+  }
+}
+
+inline void KBucket::AddReplacement(const NodeEntrance& node) {
+  auto begin = replacements_.begin();
+  auto end = begin + replacements_size_;
+
+  auto it = std::find_if(begin, end, [&node](const NodeEntrance& n) { return n.id == node.id; });
+  if (it != end) {
+    std::move(it + 1, end, it);
+    --replacements_size_;
+  } else if (replacements_size_ == kReplacementsCapacity) {
+    std::move(begin + 1, end, begin);
+    --replacements_size_;
+  }
+
+  replacements_[replacements_size_++] = node;
+}
+
+inline bool KBucket::PopReplacement(NodeEntrance& node) {
+  if (!replacements_size_) return false;
+  node = replacements_[--replacements_size_];
+  return true;
 }
 
 } // namespace net
@@ -1,174 +1,174 @@
 #include "kademlia_datagram.h"
 
 namespace net {
+namespace {
 
-std::unique_ptr<KademliaDatagram>
-KademliaDatagram::ReinterpretUdpPacket(const bi::udp::endpoint& from, const ByteVector& data) {
+// Liveness traffic must not wait behind lookup bursts,
+// otherwise peers evict us from their k-buckets.
+UdpDatagram::Priority SendPriority(uint8_t type) {
+  switch (type) {
+    case PingDatagram::type :
+    case PingRespDatagram::type :
+      return UdpDatagram::kHigh;
+    default :
+      return UdpDatagram::kNormal;
+  }
+}
+} // namespace
+
+std::optional<AnyDatagram> ReinterpretUdpPacket(const bi::udp::endpoint& from, ByteView data) {
   Unserializer u(data.data(), data.size());
   uint8_t type;
-  if (!u.Get(type)) return nullptr;
+  if (!u.Get(type) || (type >> 4) != kProtocolVersion) return std::nullopt;
+  type &= 0x0f;
+
   NodeEntrance node_from;
-  if (!node_from.GetId(u)) return nullptr;
-  if (!u.Get(node_from.tcp_port)) return nullptr;
+  if (!node_from.GetId(u)) return std::nullopt;
+  if (!u.GetFixed(node_from.tcp_port)) return std::nullopt;
   node_from.address = from.address();
   node_from.udp_port = from.port();
 
   switch (type) {
     case PingDatagram::type :
-      u.Get(node_from.user_data);
-      return std::make_unique<PingDatagram>(node_from);
+      if (!u.GetVarint(node_from.user_data)) return std::nullopt;
+      return AnyDatagram(std::in_place_type<PingDatagram>, node_from);
 
     case PingRespDatagram::type :
-      u.Get(node_from.user_data);
-      return std::make_unique<PingRespDatagram>(node_from);
+      if (!u.GetVarint(node_from.user_data)) return std::nullopt;
+      return AnyDatagram(std::in_place_type<PingRespDatagram>, node_from);
 
     case FindNodeDatagram::type : {
       NodeId target;
-      if (!u.Get(reinterpret_cast<uint8_t*>(target.GetPtr()), target.size())) return nullptr;
-      u.Get(node_from.user_data);
-      return std::make_unique<FindNodeDatagram>(node_from, target);
+      if (!u.Get(reinterpret_cast<uint8_t*>(target.GetPtr()), target.size())) return std::nullopt;
+      if (!u.GetVarint(node_from.user_data)) return std::nullopt;
+      return AnyDatagram(std::in_place_type<FindNodeDatagram>, node_from, target);
     }
 
     case FindNodeRespDatagram::type : {
       NodeId target;
-      if (!u.Get(reinterpret_cast<uint8_t*>(target.GetPtr()), target.size())) return nullptr;
+      if (!u.Get(reinterpret_cast<uint8_t*>(target.GetPtr()), target.size())) return std::nullopt;
       std::vector<NodeEntrance> closest;
-      size_t v_size;
-      if (!u.Get(v_size)) return nullptr;
-      for (size_t i = 0; i < v_size; ++i) {
+      uint64_t v_size;
+      if (!u.GetVarint(v_size)) return std::nullopt;
+      for (uint64_t i = 0; i < v_size; ++i) {
         NodeEntrance ent;
-        if (!u.Get(ent)) return nullptr;
+        if (!u.Get(ent)) return std::nullopt;
         closest.push_back(ent);
       }
-      u.Get(node_from.user_data);
-      return std::make_unique<FindNodeRespDatagram>(node_from, target, std::move(closest));
+      if (!u.GetVarint(node_from.user_data)) return std::nullopt;
+      return AnyDatagram(std::in_place_type<FindNodeRespDatagram>, node_from, target, std::move(closest));
     }
 
     case FindFragmentDatagram::type : {
       FragmentId id;
-      if (!u.Get(reinterpret_cast<uint8_t*>(id.GetPtr()), id.size())) return nullptr;
-      u.Get(node_from.user_data);
-      return std::make_unique<FindFragmentDatagram>(node_from, id);
+      if (!u.Get(reinterpret_cast<uint8_t*>(id.GetPtr()), id.size())) return std::nullopt;
+      if (!u.GetVarint(node_from.user_data)) return std::nullopt;
+      return AnyDatagram(std::in_place_type<FindFragmentDatagram>, node_from, id);
     }
 
     case FragmentFoundDatagram::type : {
       FragmentId target;
-      if (!u.Get(reinterpret_cast<uint8_t*>(target.GetPtr()), target.size())) return nullptr;
+      if (!u.Get(reinterpret_cast<uint8_t*>(target.GetPtr()), target.size())) return std::nullopt;
       ByteVector fragment;
-      if (!u.Get(fragment)) return nullptr;
-      u.Get(node_from.user_data);
-      return std::make_unique<FragmentFoundDatagram>(node_from, target, std::move(fragment));
+      if (!u.Get(fragment)) return std::nullopt;
+      if (!u.GetVarint(node_from.user_data)) return std::nullopt;
+      return AnyDatagram(std::in_place_type<FragmentFoundDatagram>, node_from, target, std::move(fragment));
     }
 
     case FragmentNotFoundDatagram::type : {
       FragmentId target;
-      if (!u.Get(reinterpret_cast<uint8_t*>(target.GetPtr()), target.size())) return nullptr;
+      if (!u.Get(reinterpret_cast<uint8_t*>(target.GetPtr()), target.size())) return std::nullopt;
       std::vector<NodeEntrance> closest;
-      size_t v_size;
-      if (!u.Get(v_size)) return nullptr;
-      for (size_t i = 0; i < v_size; ++i) {
+      uint64_t v_size;
+      if (!u.GetVarint(v_size)) return std::nullopt;
+      for (uint64_t i = 0; i < v_size; ++i) {
         NodeEntrance ent;
-        if (!u.Get(ent)) return nullptr;
+        if (!u.Get(ent)) return std::nullopt;
         closest.push_back(ent);
       }
-      u.Get(node_from.user_data);
-      return std::make_unique<FragmentNotFoundDatagram>(node_from, target, std::move(closest));
+      if (!u.GetVarint(node_from.user_data)) return std::nullopt;
+      return AnyDatagram(std::in_place_type<FragmentNotFoundDatagram>, node_from, target, std::move(closest));
     }
 
     case StoreDatagram::type : {
       FragmentId target;
-      if (!u.Get(reinterpret_cast<uint8_t*>(target.GetPtr()), target.size())) return nullptr;
+      if (!u.Get(reinterpret_cast<uint8_t*>(target.GetPtr()), target.size())) return std::nullopt;
       ByteVector fragment;
-      if (!u.Get(fragment)) return nullptr;
-      u.Get(node_from.user_data);
-      return std::make_unique<StoreDatagram>(node_from, target, std::move(fragment));
+      if (!u.Get(fragment)) return std::nullopt;
+      if (!u.GetVarint(node_from.user_data)) return std::nullopt;
+      return AnyDatagram(std::in_place_type<StoreDatagram>, node_from, target, std::move(fragment));
     }
 
     default :
-      return nullptr;
+      return std::nullopt;
   }
 }
 
-UdpDatagram KademliaDatagram::BaseToUdp(const NodeEntrance& dest, uint8_t type, bool user_data) const noexcept {
-  Serializer s;
-  s.Put(type);
-  node_from.PutId(s);
-  s.Put(node_from.tcp_port);
-  if (user_data) {
-    s.Put(node_from.user_data);
-  }
+UdpDatagram KademliaDatagram::ToUdp(const NodeEntrance& dest, Payload payload, uint8_t type) {
   bi::udp::endpoint to(dest.address, dest.udp_port);
-  return UdpDatagram(to, s.GetData());
+  return UdpDatagram(to, std::move(payload), SendPriority(type));
+}
+
+void KademliaDatagram::PutHeader(Serializer& s, uint8_t type) const {
+  s.Put(static_cast<uint8_t>(kProtocolVersion << 4 | type));
+  node_from.PutId(s);
+  s.PutFixed(node_from.tcp_port);
+}
+
+void PingDatagram::Put(Serializer& s) const {
+  PutHeader(s, type);
+  s.PutVarint(node_from.user_data);
+}
+
+void PingRespDatagram::Put(Serializer& s) const {
+  PutHeader(s, type);
+  s.PutVarint(node_from.user_data);
 }
 
-UdpDatagram FindNodeDatagram::ToUdp(const NodeEntrance& dest) const noexcept {
-  auto base_udp = BaseToUdp(dest, type, false);
-  Serializer s;
+void FindNodeDatagram::Put(Serializer& s) const {
+  PutHeader(s, type);
   s.Put(reinterpret_cast<const uint8_t*>(target.GetPtr()), target.size());
-  s.Put(node_from.user_data);
-  auto& buf = base_udp.Data();
-  buf.insert(buf.end(), s.GetData().begin(), s.GetData().end());
-  return base_udp;
+  s.PutVarint(node_from.user_data);
 }
 
-UdpDatagram FindNodeRespDatagram::ToUdp(const NodeEntrance& dest) const noexcept {
-  auto base_udp = BaseToUdp(dest, type, false);
-  Serializer s;
+void FindNodeRespDatagram::Put(Serializer& s) const {
+  PutHeader(s, type);
   s.Put(reinterpret_cast<const uint8_t*>(target.GetPtr()), target.size());
-  s.Put(closest.size());
+  s.PutVarint(closest.size());
   for (size_t i = 0; i < closest.size(); ++i) {
     s.Put(closest[i]);
   }
-  s.Put(node_from.user_data);
-  auto& buf = base_udp.Data();
-  buf.insert(buf.end(), s.GetData().begin(), s.GetData().end());
-  return base_udp;
+  s.PutVarint(node_from.user_data);
 }
 
-UdpDatagram FindFragmentDatagram::ToUdp(const NodeEntrance& dest) const noexcept {
-  auto base_udp = BaseToUdp(dest, type, false);
-  Serializer s;
+void FindFragmentDatagram::Put(Serializer& s) const {
+  PutHeader(s, type);
   s.Put(reinterpret_cast<const uint8_t*>(target.GetPtr()), target.size());
-  s.Put(node_from.user_data);
-  auto& buf = base_udp.Data();
-  buf.insert(buf.end(), s.GetData().begin(), s.GetData().end());
-  return base_udp;
+  s.PutVarint(node_from.user_data);
 }
 
-UdpDatagram FragmentFoundDatagram::ToUdp(const NodeEntrance& dest) const noexcept {
-  auto base_udp = BaseToUdp(dest, type, false);
-  Serializer s;
+void FragmentFoundDatagram::Put(Serializer& s) const {
+  PutHeader(s, type);
   s.Put(reinterpret_cast<const uint8_t*>(target.GetPtr()), target.size());
   s.Put(fragment);
-  s.Put(node_from.user_data);
-  auto& buf = base_udp.Data();
-  buf.insert(buf.end(), s.GetData().begin(), s.GetData().end());
-  return base_udp;
+  s.PutVarint(node_from.user_data);
 }
 
-UdpDatagram FragmentNotFoundDatagram::ToUdp(const NodeEntrance& dest) const noexcept {
-  auto base_udp = BaseToUdp(dest, type, false);
-  Serializer s;
+void FragmentNotFoundDatagram::Put(Serializer& s) const {
+  PutHeader(s, type);
   s.Put(reinterpret_cast<const uint8_t*>(target.GetPtr()), target.size());
-  s.Put(closest.size());
+  s.PutVarint(closest.size());
   for (size_t i = 0; i < closest.size(); ++i) {
     s.Put(closest[i]);
   }
-  s.Put(node_from.user_data);
-  auto& buf = base_udp.Data();
-  buf.insert(buf.end(), s.GetData().begin(), s.GetData().end());
-  return base_udp;
+  s.PutVarint(node_from.user_data);
 }
 
-UdpDatagram StoreDatagram::ToUdp(const NodeEntrance& dest) const noexcept {
-  auto base_udp = BaseToUdp(dest, type, false);
-  Serializer s;
+void StoreDatagram::Put(Serializer& s) const {
+  PutHeader(s, type);
   s.Put(reinterpret_cast<const uint8_t*>(id.GetPtr()), id.size());
   s.Put(fragment);
-  s.Put(node_from.user_data);
-  auto& buf = base_udp.Data();
-  buf.insert(buf.end(), s.GetData().begin(), s.GetData().end());
-  return base_udp;
+  s.PutVarint(node_from.user_data);
 }
 
 } // namespace net
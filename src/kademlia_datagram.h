@@ -2,6 +2,8 @@
 #define NET_KADEMLIA_DATAGRAM_H
 
 #include <memory>
+#include <optional>
+#include <variant>
 #include <vector>
 
 #include "common.h"
@@ -10,31 +12,54 @@
 namespace net {
 
 struct KademliaDatagram {
+  // Encoded datagram doesn't depend on receiver,
+  // so one payload is shared by all receivers.
+  using Payload = std::shared_ptr<const ByteVector>;
+
+  // type + sender id + tcp port + max user data
+  static constexpr size_t kHeaderSize = sizeof(uint8_t) + sizeof(NodeId) +
+                                        sizeof(uint16_t) + kMaxVarintSize;
+
+  // max size of encoded NodeEntrance with ipv4 address
+  static constexpr size_t kNodeEntranceSize = sizeof(NodeId) + sizeof(uint8_t) + 4 +
+                                              2 * sizeof(uint16_t) + kMaxVarintSize;
+
   KademliaDatagram(const NodeEntrance& node_from)
       : node_from(node_from) {}
 
-  virtual uint8_t DatagramType() const noexcept = 0;
-  virtual ~KademliaDatagram() = default;
-
-  static std::unique_ptr<KademliaDatagram>
-  ReinterpretUdpPacket(const bi::udp::endpoint& ep, const ByteVector& data);
+  static UdpDatagram ToUdp(const NodeEntrance& to, Payload, uint8_t type);
 
-  UdpDatagram BaseToUdp(const NodeEntrance& to, uint8_t type, bool user_data) const noexcept;
+  void PutHeader(Serializer&, uint8_t type) const;
 
   NodeEntrance node_from;
 };
 
+// Serializes datagram once into pre-sized buffer.
+template<class Datagram>
+ByteVector EncodeBytes(const Datagram& d) {
+  Serializer s;
+  s.Reserve(d.SizeHint());
+  d.Put(s);
+  return s.Release();
+}
+
+template<class Datagram>
+KademliaDatagram::Payload Encode(const Datagram& d) {
+  return std::make_shared<const ByteVector>(EncodeBytes(d));
+}
+
 struct PingDatagram : public KademliaDatagram {
   static constexpr uint8_t type = 1;
 
   PingDatagram(const NodeEntrance& node_from)
     : KademliaDatagram(node_from) {}
 
-  UdpDatagram ToUdp(const NodeEntrance& to) const noexcept {
-    return BaseToUdp(to, type, true);
-  }
+  size_t SizeHint() const noexcept { return kHeaderSize; }
+  void Put(Serializer&) const;
 
-  uint8_t DatagramType() const noexcept override { return type; }
+  UdpDatagram ToUdp(const NodeEntrance& to) const {
+    return KademliaDatagram::ToUdp(to, Encode(*this), type);
+  }
 };
 
 struct PingRespDatagram : public KademliaDatagram {
@@ -43,11 +68,12 @@ struct PingRespDatagram : public KademliaDatagram {
   PingRespDatagram(const NodeEntrance& node_from)
     : KademliaDatagram(node_from) {}
 
-  UdpDatagram ToUdp(const NodeEntrance& to) const noexcept {
-    return BaseToUdp(to, type, true);
-  }
+  size_t SizeHint() const noexcept { return kHeaderSize; }
+  void Put(Serializer&) const;
 
-  uint8_t DatagramType() const noexcept override { return type; }
+  UdpDatagram ToUdp(const NodeEntrance& to) const {
+    return KademliaDatagram::ToUdp(to, Encode(*this), type);
+  }
 };
 
 struct FindNodeDatagram : public KademliaDatagram {
@@ -59,8 +85,12 @@ struct FindNodeDatagram : public KademliaDatagram {
 
   NodeId target;
 
-  UdpDatagram ToUdp(const NodeEntrance& to) const noexcept;
-  uint8_t DatagramType() const noexcept override { return type; }
+  size_t SizeHint() const noexcept { return kHeaderSize + sizeof(NodeId); }
+  void Put(Serializer&) const;
+
+  UdpDatagram ToUdp(const NodeEntrance& to) const {
+    return KademliaDatagram::ToUdp(to, Encode(*this), type);
+  }
 };
 
 struct FindNodeRespDatagram: public KademliaDatagram {
@@ -75,8 +105,14 @@ struct FindNodeRespDatagram: public KademliaDatagram {
   NodeId target;
   std::vector<NodeEntrance> closest;
 
-  UdpDatagram ToUdp(const NodeEntrance& to) const noexcept;
-  uint8_t DatagramType() const noexcept override { return type; }
+  size_t SizeHint() const noexcept {
+    return kHeaderSize + sizeof(NodeId) + kMaxVarintSize + closest.size() * kNodeEntranceSize;
+  }
+  void Put(Serializer&) const;
+
+  UdpDatagram ToUdp(const NodeEntrance& to) const {
+    return KademliaDatagram::ToUdp(to, Encode(*this), type);
+  }
 };
 
 struct FindFragmentDatagram : public KademliaDatagram {
@@ -87,8 +123,12 @@ struct FindFragmentDatagram : public KademliaDatagram {
 
   FragmentId target;
 
-  UdpDatagram ToUdp(const NodeEntrance& to) const noexcept;
-  uint8_t DatagramType() const noexcept override { return type; }
+  size_t SizeHint() const noexcept { return kHeaderSize + sizeof(FragmentId); }
+  void Put(Serializer&) const;
+
+  UdpDatagram ToUdp(const NodeEntrance& to) const {
+    return KademliaDatagram::ToUdp(to, Encode(*this), type);
+  }
 };
 
 struct FragmentFoundDatagram : public KademliaDatagram {
@@ -100,8 +140,14 @@ struct FragmentFoundDatagram : public KademliaDatagram {
   FragmentId target;
   ByteVector fragment;
 
-  UdpDatagram ToUdp(const NodeEntrance& to) const noexcept;
-  uint8_t DatagramType() const noexcept override { return type; }
+  size_t SizeHint() const noexcept {
+    return kHeaderSize + sizeof(FragmentId) + kMaxVarintSize + fragment.size();
+  }
+  void Put(Serializer&) const;
+
+  UdpDatagram ToUdp(const NodeEntrance& to) const {
+    return KademliaDatagram::ToUdp(to, Encode(*this), type);
+  }
 };
 
 struct FragmentNotFoundDatagram : public KademliaDatagram {
@@ -116,8 +162,14 @@ struct FragmentNotFoundDatagram : public KademliaDatagram {
   FragmentId target;
   std::vector<NodeEntrance> closest;
 
-  UdpDatagram ToUdp(const NodeEntrance& to) const noexcept;
-  uint8_t DatagramType() const noexcept override { return type; }
+  size_t SizeHint() const noexcept {
+    return kHeaderSize + sizeof(FragmentId) + kMaxVarintSize + closest.size() * kNodeEntranceSize;
+  }
+  void Put(Serializer&) const;
+
+  UdpDatagram ToUdp(const NodeEntrance& to) const {
+    return KademliaDatagram::ToUdp(to, Encode(*this), type);
+  }
 };
 
 struct StoreDatagram : public KademliaDatagram {
@@ -129,9 +181,27 @@ struct StoreDatagram : public KademliaDatagram {
   FragmentId id;
   ByteVector fragment;
 
-  UdpDatagram ToUdp(const NodeEntrance& to) const noexcept;
-  uint8_t DatagramType() const noexcept override { return type; }
+  size_t SizeHint() const noexcept {
+    return kHeaderSize + sizeof(FragmentId) + kMaxVarintSize + fragment.size();
+  }
+  void Put(Serializer&) const;
+
+  UdpDatagram ToUdp(const NodeEntrance& to) const {
+    return KademliaDatagram::ToUdp(to, Encode(*this), type);
+  }
 };
 
+using AnyDatagram = std::variant<PingDatagram,
+                                 PingRespDatagram,
+                                 FindNodeDatagram,
+                                 FindNodeRespDatagram,
+                                 FindFragmentDatagram,
+                                 FragmentFoundDatagram,
+                                 FragmentNotFoundDatagram,
+                                 StoreDatagram>;
+
+// Parses datagram in place, without heap allocation of datagram object.
+std::optional<AnyDatagram> ReinterpretUdpPacket(const bi::udp::endpoint& ep, ByteView data);
+
 } // namespace net
 #endif // NET_KADEMLIA_DATAGRAM_H
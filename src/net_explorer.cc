@@ -1,13 +1,48 @@
 #include "routing_table.h"
 
-#include <random>
-
 namespace net {
+namespace {
+
+// Random id which shares first index bits with own id and differs in the next one,
+// so it falls into k-bucket with this index.
+NodeId RandomIdInBucket(const NodeId& own, uint16_t index, std::mt19937& gen) {
+  std::uniform_int_distribution<uint32_t> dist;
+
+  NodeId id;
+  uint32_t* ptr = id.GetPtr();
+  const uint32_t* own_ptr = own.GetPtr();
+  const size_t words = id.size() / sizeof(uint32_t);
+  std::generate(ptr, ptr + words, [&gen, &dist]() -> uint32_t { return dist(gen); });
+
+  // words are little endian, most significant word is the last one
+  size_t common_words = index / 32;
+  for (size_t i = 0; i < common_words; ++i) {
+    ptr[words - 1 - i] = own_ptr[words - 1 - i];
+  }
+
+  auto w = words - 1 - common_words;
+  uint32_t bit = 1u << (31 - index % 32);
+  uint32_t prefix = ~static_cast<uint32_t>((static_cast<uint64_t>(bit) << 1) - 1);
+  ptr[w] = (own_ptr[w] & prefix) | (~own_ptr[w] & bit) | (ptr[w] & (bit - 1));
+
+  return id;
+}
+} // namespace
 
-RoutingTable::NetExplorer::NetExplorer(RoutingTable& rt, bool full_discovery)
-    : routing_table_(rt), full_discovery_(full_discovery) {}
+RoutingTable::NetExplorer::NetExplorer(RoutingTable& rt, bool full_discovery,
+                                       std::chrono::seconds refresh_interval)
+    : routing_table_(rt),
+      full_discovery_(full_discovery),
+      refresh_interval_(refresh_interval),
+      // all buckets are stale on start, kMaxRefreshesPerRound limits the burst;
+      // steady clock epoch may be recent, so time_point{} is not old enough
+      bucket_lookups_(rt.kBucketsNum, std::chrono::steady_clock::now() - refresh_interval) {}
 
 RoutingTable::NetExplorer::~NetExplorer() {
+  Join();
+}
+
+void RoutingTable::NetExplorer::Join() {
   if (discovery_thread_.joinable()) {
     discovery_thread_.join();
   }
@@ -15,8 +50,14 @@ RoutingTable::NetExplorer::~NetExplorer() {
 
 void RoutingTable::NetExplorer::GetKnownNodes(std::vector<NodeEntrance>& result) {
   Guard g(nodes_mux_);
-  auto& nodes = nodes_.actual.size() ? nodes_.actual : nodes_.updates;
-  result.insert(result.end(), nodes.begin(), nodes.end());
+  result.reserve(result.size() + known_nodes_.Size());
+  known_nodes_.Export(CrawlerStore::Cursor(), known_nodes_.Size(), result);
+}
+
+CrawlerStore::Cursor RoutingTable::NetExplorer::GetKnownNodes(CrawlerStore::Cursor cursor, size_t limit,
+                                                              std::vector<NodeEntrance>& result) {
+  Guard g(nodes_mux_);
+  return known_nodes_.Export(cursor, limit, result);
 }
 
 void RoutingTable::NetExplorer::Start(std::future<void>&& stop_condition) {
@@ -25,73 +66,221 @@ void RoutingTable::NetExplorer::Start(std::future<void>&& stop_condition) {
 
 void RoutingTable::NetExplorer::DiscoveryRoutine(std::future<void>&& stop_condition) {
   std::mt19937 gen(std::random_device().operator()());
-  std::uniform_int_distribution<uint32_t> dist;
+  auto last_dump = std::chrono::steady_clock::now();
+  auto interval = std::min<std::chrono::seconds>(kDiscoveryInterval, refresh_interval_);
 
   while (true) {
-    if (stop_condition.wait_for(kDiscoveryInterval) == std::future_status::ready) break;
+    if (stop_condition.wait_for(interval) == std::future_status::ready) break;
+
+    if (std::chrono::steady_clock::now() - last_dump >= kDumpInterval) {
+      routing_table_.DumpToFile();
+      last_dump = std::chrono::steady_clock::now();
+    }
 
     if (full_discovery_) UpdateNodes();
 
-    NodeId random_id;
-    uint32_t* ptr = random_id.GetPtr();
-    std::generate(ptr, ptr + random_id.size() / sizeof(uint32_t), [&gen, &dist]() -> uint32_t { return dist(gen); });
+    RefreshStaleBuckets(gen);
+  }
+}
+
+void RoutingTable::NetExplorer::RefreshStaleBuckets(std::mt19937& gen) {
+  if (routing_table_.total_nodes_ == 0) return;
 
-    Find(random_id, routing_table_.NearestNodes(random_id));
+  // buckets deeper than the deepest non empty one are covered by lookups into it
+  int32_t deepest = -1;
+  for (uint16_t i = 0; i < routing_table_.kBucketsNum; ++i) {
+    SharedGuard g(routing_table_.k_buckets_[i].mux);
+    if (routing_table_.k_buckets_[i].nodes.Size()) deepest = i;
+  }
+
+  std::vector<uint16_t> stale;
+  {
+   Guard g(find_node_mux_);
+   auto now = std::chrono::steady_clock::now();
+   for (int32_t i = 0; i <= deepest && stale.size() < kMaxRefreshesPerRound; ++i) {
+     if (now - bucket_lookups_[i] >= refresh_interval_) stale.push_back(static_cast<uint16_t>(i));
+   }
+  }
+
+  for (auto i : stale) {
+    auto target = RandomIdInBucket(routing_table_.host_data_.id, i, gen);
+    LOG(DEBUG) << "Refresh k-bucket " << i;
+    Find(target, routing_table_.NearestNodes(target, true));
   }
 }
 
 void RoutingTable::NetExplorer::Find(const NodeId& id, const std::vector<NodeEntrance>& find_list) {
+  uint64_t generation;
   {
    Guard g(find_node_mux_);
-   auto& nodes_to_query = find_node_sent_[id];
-   if (nodes_to_query.size() != 0) {
+   auto [it, inserted] = lookups_.try_emplace(id);
+   if (!inserted) {
      // Find node procedure has already been started for this node.
      return;
    }
 
-   FindNodeDatagram d(routing_table_.host_data_, id);
-   for (auto& node : find_list) {
-     nodes_to_query.push_back(node.id);
-     routing_table_.socket_->Send(d.ToUdp(node));
+   auto index = routing_table_.KBucketIndex(id);
+   if (index != kIvalidIndex) bucket_lookups_[index] = std::chrono::steady_clock::now();
+
+   auto& lookup = it->second;
+   lookup.generation = generation = next_generation_++;
+   lookup.started = std::chrono::steady_clock::now();
+   AddCandidates(id, lookup, find_list);
+
+   if (!Advance(id, lookup)) {
+     Finish(it, nullptr);
+     return;
    }
   }
 
+  // upper bound of lookup duration
   auto timer = std::make_shared<DeadlineTimer>(
                 routing_table_.io_, boost::posix_time::seconds(kDiscoveryExpirationSeconds.count()));
 
-  auto callback = [this, timer, id](const boost::system::error_code&) {
-                    bool node_found = true;
-                    {
-                     Guard g(find_node_mux_);
-                     if (find_node_sent_.erase(id)) {
-                       node_found = false;
-                     }
+  auto callback = [this, timer, id, generation](const boost::system::error_code&) {
+                    Guard g(find_node_mux_);
+                    auto it = lookups_.find(id);
+                    if (it != lookups_.end() && it->second.generation == generation) {
+                      Finish(it, nullptr);
                     }
+                  };
+
+  timer->async_wait(std::move(callback));
+}
+
+void RoutingTable::NetExplorer::AddCandidates(const NodeId& target, Lookup& lookup,
+                                              const std::vector<NodeEntrance>& nodes) {
+  for (auto& node : nodes) {
+    if (node.id == routing_table_.host_data_.id) continue;
+    if (!lookup.seen.insert(node.id).second) continue;
+
+    lookup.shortlist.push_back({XorDistance(target, node.id), node, Lookup::State::kNotQueried,
+                                routing_table_.GetRttKey(node.id), {}});
+  }
 
-                    if (!node_found) {
-                      routing_table_.OnNodeNotFound(id);
+  auto& shortlist = lookup.shortlist;
+  std::sort(shortlist.begin(), shortlist.end(),
+            [](const Lookup::Candidate& l, const Lookup::Candidate& r) { return l.distance < r.distance; });
+
+  if (shortlist.size() > kMaxShortlistSize) {
+    for (auto it = shortlist.begin() + kMaxShortlistSize; it != shortlist.end(); ++it) {
+      if (it->state == Lookup::State::kInFlight) --lookup.in_flight;
+    }
+    shortlist.resize(kMaxShortlistSize);
+  }
+}
+
+bool RoutingTable::NetExplorer::Advance(const NodeId& target, Lookup& lookup) {
+  std::vector<Lookup::Candidate*> not_queried;
+  size_t alive = 0;
+
+  for (auto& c : lookup.shortlist) {
+    if (alive == k) break;
+    if (c.state == Lookup::State::kFailed) continue;
+
+    ++alive;
+    if (c.state == Lookup::State::kNotQueried) not_queried.push_back(&c);
+  }
+
+  // all of k closest have to answer, fast ones are queried first
+  size_t free_slots = lookup.in_flight < kAlpha ? kAlpha - lookup.in_flight : 0;
+  auto to_send = std::min(free_slots, not_queried.size());
+  std::partial_sort(not_queried.begin(), not_queried.begin() + to_send, not_queried.end(),
+                    [](const Lookup::Candidate* l, const Lookup::Candidate* r) { return l->rtt_key < r->rtt_key; });
+
+  std::vector<NodeEntrance> to_query;
+  auto now = std::chrono::steady_clock::now();
+
+  for (size_t i = 0; i < to_send; ++i) {
+    auto& c = *not_queried[i];
+    c.state = Lookup::State::kInFlight;
+    c.sent = now;
+    ++lookup.in_flight;
+    ++lookup.queries;
+    to_query.push_back(c.node);
+    StartQueryTimer(target, c.node.id, lookup.generation);
+  }
+
+  routing_table_.SendToSocket(FindNodeDatagram(routing_table_.host_data_, target), to_query);
+
+  // nothing in flight means k closest alive nodes have answered
+  return lookup.in_flight > 0;
+}
+
+void RoutingTable::NetExplorer::StartQueryTimer(const NodeId& target, const NodeId& node, uint64_t generation) {
+  auto timer = std::make_shared<DeadlineTimer>(
+                routing_table_.io_, boost::posix_time::milliseconds(kFindNodeTimeout.count()));
+
+  auto callback = [this, timer, target, node, generation](const boost::system::error_code&) {
+                    Guard g(find_node_mux_);
+                    auto it = lookups_.find(target);
+                    if (it == lookups_.end() || it->second.generation != generation) return;
+
+                    auto& lookup = it->second;
+                    auto c = std::find_if(lookup.shortlist.begin(), lookup.shortlist.end(),
+                                          [&node](const Lookup::Candidate& c) { return c.node.id == node; });
+                    if (c == lookup.shortlist.end() || c->state != Lookup::State::kInFlight) return;
+
+                    c->state = Lookup::State::kFailed;
+                    --lookup.in_flight;
+
+                    if (!Advance(target, lookup)) {
+                      Finish(it, nullptr);
                     }
                   };
 
   timer->async_wait(std::move(callback));
 }
 
-void RoutingTable::NetExplorer::CheckFindNodeResponce(const KademliaDatagram& d) {
-  auto& find_node_resp = dynamic_cast<const FindNodeRespDatagram&>(d);
+void RoutingTable::NetExplorer::Finish(Lookups::iterator it, const NodeEntrance* found) {
+  auto& lookup = it->second;
+  auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now() - lookup.started);
+  LOG(DEBUG) << "Lookup of " << IdToBase58(it->first) << (found ? " found" : " not found")
+             << " in " << duration.count() << " ms, queries " << lookup.queries;
+
+  std::vector<NodeEntrance> closest;
+  for (auto& c : lookup.shortlist) {
+    if (closest.size() == k) break;
+    if (c.state == Lookup::State::kAnswered) closest.push_back(c.node);
+  }
+
+  if (found) {
+    routing_table_.OnNodeFound(*found, std::move(closest));
+  } else {
+    routing_table_.OnNodeNotFound(it->first, std::move(closest));
+  }
+
+  lookups_.erase(it);
+}
+
+std::optional<std::chrono::milliseconds>
+RoutingTable::NetExplorer::CheckFindNodeResponce(const FindNodeRespDatagram& find_node_resp) {
   NodeEntrance founded_node;
+  std::chrono::steady_clock::duration rtt;
 
   {
    Guard g(find_node_mux_);
-   auto find_node_request = find_node_sent_.find(find_node_resp.target);
-   if (find_node_request == find_node_sent_.end()) return;
+   auto find_node_request = lookups_.find(find_node_resp.target);
+   if (find_node_request == lookups_.end()) return std::nullopt;
+
+   auto& lookup = find_node_request->second;
+   auto c = std::find_if(lookup.shortlist.begin(), lookup.shortlist.end(),
+                         [&find_node_resp](const Lookup::Candidate& c) {
+                           return c.node.id == find_node_resp.node_from.id;
+                         });
 
-   auto& already_queried = find_node_request->second;
-   if (std::find(already_queried.begin(), already_queried.end(),
-                 find_node_resp.node_from.id) == already_queried.end()) {
+   if (c == lookup.shortlist.end() ||
+       c->state == Lookup::State::kNotQueried || c->state == Lookup::State::kAnswered) {
      LOG(DEBUG) << "Unexpected find node responce.";
-     return;
+     return std::nullopt;
    }
 
+   // late answer to timed out query is still useful
+   if (c->state == Lookup::State::kInFlight) --lookup.in_flight;
+   c->state = Lookup::State::kAnswered;
+   rtt = std::chrono::steady_clock::now() - c->sent;
+
    auto& closest_nodes = find_node_resp.closest;
 
    if (full_discovery_) {
@@ -105,47 +294,43 @@ void RoutingTable::NetExplorer::CheckFindNodeResponce(const KademliaDatagram& d)
                  });
 
    if (it == closest_nodes.end()) {
-     for (auto& n : closest_nodes) {
-       if (n.id == routing_table_.host_data_.id) continue;
-
-       if (std::find(already_queried.begin(), already_queried.end(),
-                     n.id) == already_queried.end()) {
-         FindNodeDatagram new_request(routing_table_.host_data_, find_node_resp.target);
-         routing_table_.socket_->Send(new_request.ToUdp(n));
-         already_queried.push_back(n.id);
-       }
+     AddCandidates(find_node_resp.target, lookup, closest_nodes);
+     if (!Advance(find_node_resp.target, lookup)) {
+       Finish(find_node_request, nullptr);
      }
-     return;
+     return std::chrono::duration_cast<std::chrono::milliseconds>(rtt);
    }
 
    founded_node = *it;
-   find_node_sent_.erase(find_node_request);
-   routing_table_.OnNodeFound(founded_node);
+   Finish(find_node_request, &founded_node);
   }
 
-  Guard g(routing_table_.k_bucket_mux_);
-
   auto index = routing_table_.KBucketIndex(founded_node.id);
-  if (index == kIvalidIndex) return;
+  if (index != kIvalidIndex) {
+    routing_table_.pinger_.SendPing(founded_node, index);
+  }
 
-  auto& bucket = routing_table_.k_buckets_[index];
-  routing_table_.pinger_.SendPing(founded_node, bucket);
+  return std::chrono::duration_cast<std::chrono::milliseconds>(rtt);
 }
 
-void RoutingTable::NetExplorer::UpdateNodes() {
-  using namespace std::chrono;
-  static auto last_update = steady_clock::now();
-  auto current_time = steady_clock::now();
+void RoutingTable::NetExplorer::GetClosestKnownNodes(const NodeId& target, size_t k,
+                                                     std::vector<NodeEntrance>& result) {
+  Guard g(nodes_mux_);
+  known_nodes_.Closest(target, k, result);
+}
 
-  if (duration_cast<seconds>(current_time - last_update) >= kUpdateNodesInterval) {
-    Guard g(nodes_mux_);
-    nodes_.actual = std::move(nodes_.updates);
-    last_update = steady_clock::now();
+void RoutingTable::NetExplorer::UpdateNodes() {
+  Guard g(nodes_mux_);
+  auto removed = known_nodes_.Expire(kKnownNodeMaxAge);
+  if (removed) {
+    LOG(DEBUG) << "Known nodes expired " << removed << ", left " << known_nodes_.Size();
   }
 }
 
 void RoutingTable::NetExplorer::UpdateNodes(const std::vector<NodeEntrance>& nodes) {
   Guard g(nodes_mux_);
-  nodes_.updates.insert(nodes.begin(), nodes.end());
+  for (auto& n : nodes) {
+    known_nodes_.Update(n);
+  }
 }
 } // namespace net
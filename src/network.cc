@@ -35,7 +35,7 @@ struct RegData {
     } else {
       throw std::domain_error("invalid reg data");
     }
-    s.Put(internal_port);
+    s.PutFixed(internal_port);
 
     data_ = s.GetData();
   }
@@ -64,7 +64,7 @@ struct RegData {
       return false;
     }
 
-    return u.Get(port);
+    return u.GetFixed(port);
   }
 };
 } // namespace
@@ -271,6 +271,27 @@ void Network::OnConnected(Packet&& conn_pack, Connection::Ptr conn) {
   } catch (...) {}
 }
 
+bool Network::GetRemoteContacts(const Packet& conn_pack, const Connection::Ptr& conn,
+                                NodeEntrance& contacts) {
+  bi::address internal_addr;
+  uint16_t internal_port;
+  if (!RegData::Unserialize(conn_pack.data, internal_addr, internal_port)) return false;
+
+  Connection::Endpoint ep;
+  try {
+    ep = conn->GetEndpoint();
+  } catch (...) {
+    return false;
+  }
+
+  contacts.id = conn_pack.header.sender;
+  contacts.address = ep.address();
+  // behind NAT listening port is mapped to the port seen by us, see OnConnected
+  contacts.tcp_port = internal_addr == ep.address() ? internal_port : ep.port();
+  contacts.udp_port = contacts.tcp_port;
+  return true;
+}
+
 void Network::OnConnectionDropped(const NodeId& id, bool active) {
   if (active) return;
   RemoveIntermediaryClient(id);
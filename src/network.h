@@ -44,6 +44,9 @@ class Network {
   void OnConnectionDropped(const NodeId&, bool active);
   ByteVector GetRegistrationData();
 
+  // Contacts of remote node of passive connection from its registration packet.
+  static bool GetRemoteContacts(const Packet& conn_pack, const Connection::Ptr&, NodeEntrance&);
+
  private:
   Network() = default;
 
@@ -28,12 +28,24 @@ std::vector<NodeEntrance> ConvertNodes(const std::vector<NodeEntry>& nentries) {
   return nentrances;
 }
 
+NodeEntry ConvertNode(const NodeEntrance& input) {
+  NodeEntry output;
+  std::get<0>(output) = input.id;
+  std::get<1>(output) = input.address.to_string();
+  std::get<2>(output) = input.udp_port;
+  return output;
+}
+
 Config ConvertConfig(const ManagerConfig& mconf) {
   Config conf;
 
   conf.id = mconf.id;
   conf.listen_port = mconf.listen_port;
   conf.traverse_nat = mconf.traverse_nat;
+  conf.udp_shards = mconf.udp_shards;
+  conf.max_fragment_size = mconf.max_fragment_size;
+  conf.bucket_refresh_interval = std::chrono::seconds(
+      std::max<uint32_t>(mconf.bucket_refresh_interval_sec, 1));
   conf.use_default_boot_nodes = false;
   conf.custom_boot_nodes = ConvertNodes(mconf.boot_nodes);
 
@@ -55,18 +67,29 @@ struct Manager::Impl {
     std::vector<NodeEntrance> nodes;
     host.GetKnownNodes(nodes);
 
-    std::transform(
-      nodes.begin(),
-      nodes.end(),
-      std::back_inserter(result),
-      [](const NodeEntrance& input) {
-        NodeEntry output;
-        std::get<0>(output) = input.id;
-        std::get<1>(output) = input.address.to_string();
-        std::get<2>(output) = input.udp_port;
-        return output;
-      }
-    );
+    std::transform(nodes.begin(), nodes.end(), std::back_inserter(result), ConvertNode);
+  }
+
+  KnownNodesCursor GetKnownNodes(KnownNodesCursor cursor, size_t limit, std::vector<NodeEntry>& result) {
+    std::vector<NodeEntrance> nodes;
+    auto next = host.GetKnownNodes(CrawlerStore::Cursor{cursor.seq, cursor.slot}, limit, nodes);
+
+    std::transform(nodes.begin(), nodes.end(), std::back_inserter(result), ConvertNode);
+    return KnownNodesCursor{next.seq, next.slot};
+  }
+
+  void FindNode(const NodeId& id, std::function<void(FindNodeResult&&)> callback) {
+    host.FindNode(id, [callback = std::move(callback)](const std::optional<NodeEntrance>& found,
+                                                       const std::vector<NodeEntrance>& closest) {
+                        FindNodeResult result;
+                        if (found) {
+                          result.found = true;
+                          result.node = ConvertNode(*found);
+                        }
+                        std::transform(closest.begin(), closest.end(),
+                                       std::back_inserter(result.closest), ConvertNode);
+                        callback(std::move(result));
+                      });
   }
 };
 
@@ -91,6 +114,17 @@ void Manager::SendBroadcastIfNoConnection(const NodeId& to, ByteVector&& msg) {
   pimpl_->host.SendBroadcastIfNoConnection(to, std::move(msg));
 }
 
+void Manager::FindNode(const NodeId& id, std::function<void(FindNodeResult&&)> callback) {
+  pimpl_->FindNode(id, std::move(callback));
+}
+
+std::future<FindNodeResult> Manager::FindNode(const NodeId& id) {
+  auto promise = std::make_shared<std::promise<FindNodeResult>>();
+  auto result = promise->get_future();
+  pimpl_->FindNode(id, [promise](FindNodeResult&& r) { promise->set_value(std::move(r)); });
+  return result;
+}
+
 void Manager::AddKnownNodes(const std::vector<NodeEntry>& nodes) {
   pimpl_->AddKnownNodes(nodes);
 }
@@ -99,6 +133,10 @@ void Manager::GetKnownNodes(std::vector<NodeEntry>& result) {
   pimpl_->GetKnownNodes(result);
 }
 
+KnownNodesCursor Manager::GetKnownNodes(KnownNodesCursor cursor, size_t limit, std::vector<NodeEntry>& result) {
+  return pimpl_->GetKnownNodes(cursor, limit, result);
+}
+
 void Manager::Ban(const NodeId& id) {
   pimpl_->host.Ban(id);
 }
@@ -17,12 +17,14 @@ void RoutingTable::Pinger::Start(std::future<void>&& stop_condition) {
 }
 
 void RoutingTable::Pinger::PingRoutine(std::future<void>&& stop_condition) {
-  uint16_t current_bucket = 0;
+  auto last_boot = std::chrono::steady_clock::time_point();
 
   while (true) {
-    if (stop_condition.wait_for(kPingExpirationSeconds) == std::future_status::ready) break;
+    if (stop_condition.wait_for(kPingRoutineInterval) == std::future_status::ready) break;
 
-    if (routing_table_.total_nodes_ == 0) {
+    auto now = std::chrono::steady_clock::now();
+    if (routing_table_.total_nodes_ == 0 && now - last_boot >= kPingExpirationSeconds) {
+      last_boot = now;
       auto& config = Network::Instance().GetConfig();
       const auto& boot_nodes = config.use_default_boot_nodes ?
                                GetDefaultBootNodes() : config.custom_boot_nodes;
@@ -30,81 +32,139 @@ void RoutingTable::Pinger::PingRoutine(std::future<void>&& stop_condition) {
       routing_table_.AddNodes(boot_nodes);
     }
 
-    Guard g(routing_table_.k_bucket_mux_);
-    for (; current_bucket < routing_table_.kBucketsNum; ++current_bucket) {
-      if (routing_table_.k_buckets_[current_bucket].Size()) break;
-    }
+    CheckExpiredPings();
+    PingIdleNodes();
+  }
+}
 
-    if (current_bucket == routing_table_.kBucketsNum) {
-      current_bucket = 0;
-      continue;
-    }
+void RoutingTable::Pinger::CheckExpiredPings() {
+  std::vector<PingState> to_resend, to_evict;
+  {
+   Guard g(ping_mux_);
+   auto now = std::chrono::steady_clock::now();
+
+   for (auto it = ping_sent_.begin(); it != ping_sent_.end();) {
+     auto& state = it->second;
+     if (now - state.sent < kPingExpirationSeconds) {
+       ++it;
+       continue;
+     }
+
+     if (state.attempts >= kMaxPingsBeforeRemove) {
+       to_evict.push_back(std::move(state));
+       it = ping_sent_.erase(it);
+       continue;
+     }
+
+     ++state.attempts;
+     state.sent = now;
+     to_resend.push_back(state);
+     ++it;
+   }
+  }
+
+  PingDatagram ping(routing_table_.host_data_);
+  for (auto& s : to_resend) {
+    routing_table_.GetSocket().Send(ping.ToUdp(s.target));
+  }
+
+  for (auto& s : to_evict) {
+    Evict(s.target, s.bucket_index, s.probe);
+  }
+}
+
+void RoutingTable::Pinger::Evict(const NodeEntrance& target, uint16_t bucket_index,
+                                 bool probe) {
+  auto& locked_bucket = routing_table_.k_buckets_[bucket_index];
+  auto& bucket = locked_bucket.nodes;
+  WriteGuard g(locked_bucket.mux);
+
+  if (probe) locked_bucket.probing = false;
+  if (!bucket.Exists(target.id)) return;
+
+  bucket.Evict(target.id);
+  routing_table_.total_nodes_--;
+  routing_table_.NotifyHost(target, RoutingTableEventType::kNodeRemoved);
 
-    auto& bucket = routing_table_.k_buckets_[current_bucket];
-    auto& nodes = bucket.GetNodes();
-    for (auto& n : nodes) {
-      SendPing(n, bucket);
+  NodeEntrance replacement;
+  while (bucket.PopReplacement(replacement)) {
+    if (bucket.Exists(replacement.id) || !bucket.AddNode(replacement)) continue;
+
+    routing_table_.total_nodes_++;
+    routing_table_.NotifyHost(replacement, RoutingTableEventType::kNodeAdded);
+    break;
+  }
+}
+
+void RoutingTable::Pinger::PingIdleNodes() {
+  auto idle_since = std::chrono::system_clock::now() - kIdleBeforePing;
+  std::vector<std::pair<NodeEntrance, uint16_t>> to_ping;
+
+  for (uint16_t visited = 0; visited < routing_table_.kBucketsNum; ++visited) {
+    auto& bucket = routing_table_.k_buckets_[current_bucket_];
+    {
+     SharedGuard g(bucket.mux);
+     Guard pg(ping_mux_);
+
+     bucket.nodes.ForEachWithInfo([&](const NodeEntrance& n, const KBucket::NodeInfo& info) {
+                                    if (to_ping.size() == kMaxIdlePingsPerInterval) return;
+                                    if (info.last_seen > idle_since) return;
+                                    if (ping_sent_.find(n.id) != ping_sent_.end()) return;
+                                    to_ping.emplace_back(n, current_bucket_);
+                                  });
     }
 
-    ++current_bucket;
+    // budget is spent, rest of this bucket goes next time
+    if (to_ping.size() == kMaxIdlePingsPerInterval) break;
+
+    current_bucket_ = (current_bucket_ + 1) % routing_table_.kBucketsNum;
+  }
+
+  for (auto& p : to_ping) {
+    SendPing(p.first, p.second);
   }
 }
 
-void RoutingTable::Pinger::SendPing(const NodeEntrance& target, KBucket& bucket, std::shared_ptr<NodeEntrance> replacer) {
-  PingDatagram ping(routing_table_.host_data_);
+void RoutingTable::Pinger::SendPing(const NodeEntrance& target, uint16_t bucket_index, bool probe) {
   {
    Guard g(ping_mux_);
    auto it = ping_sent_.find(target.id);
    if (it != ping_sent_.end()) {
-     it->second++;
-   } else {
-     ping_sent_.insert(std::make_pair(target.id, replacer ? kMaxPingsBeforeRemove : 0));
+     // answer or expiration of ping in flight decides
+     if (probe) it->second.probe = true;
+     return;
    }
+
+   ping_sent_.emplace(target.id, PingState{target, bucket_index, probe,
+                                           probe ? kMaxPingsBeforeRemove : uint8_t(0),
+                                           std::chrono::steady_clock::now()});
   }
 
-  routing_table_.socket_->Send(ping.ToUdp(target));
-
-  auto timer = std::make_shared<DeadlineTimer>(
-                routing_table_.io_, boost::posix_time::seconds(kPingExpirationSeconds.count()));
-
-  auto callback = [this, target, replacer, &bucket, timer](const boost::system::error_code&) {
-                    bool resendPing = true;
-                    {
-                      std::scoped_lock g(ping_mux_, routing_table_.k_bucket_mux_);
-
-                      auto it = ping_sent_.find(target.id);
-                      if (it == ping_sent_.end()) {
-                        return;
-                      }
-
-                      if (it->second >= kMaxPingsBeforeRemove) {
-                        resendPing = false;
-                        ping_sent_.erase(it);
-
-                        if (bucket.Exists(target.id)) {
-                          bucket.Evict(target.id);
-                          routing_table_.total_nodes_--;
-                          routing_table_.NotifyHost(target, RoutingTableEventType::kNodeRemoved);
-                        }
-
-                        if (replacer && !bucket.Exists(replacer->id)) {
-                          bucket.AddNode(*replacer);
-                          routing_table_.total_nodes_++;
-                          routing_table_.NotifyHost(*replacer, RoutingTableEventType::kNodeAdded);
-                        }
-                      }
-                    }
-
-                    if (resendPing) {
-                      SendPing(target, bucket, replacer);
-                    }
-                  };
-
-  timer->async_wait(std::move(callback));
+  PingDatagram ping(routing_table_.host_data_);
+  routing_table_.GetSocket().Send(ping.ToUdp(target));
 }
 
-void RoutingTable::Pinger::CheckPingResponce(const KademliaDatagram& d) {
-  Guard g(ping_mux_);
-  ping_sent_.erase(d.node_from.id);
+std::optional<std::chrono::milliseconds> RoutingTable::Pinger::CheckPingResponce(const PingRespDatagram& d) {
+  std::chrono::steady_clock::duration rtt;
+  std::optional<uint16_t> probed_bucket;
+  {
+   Guard g(ping_mux_);
+   auto it = ping_sent_.find(d.node_from.id);
+   if (it == ping_sent_.end()) return std::nullopt;
+
+   // measured from the last attempt
+   rtt = std::chrono::steady_clock::now() - it->second.sent;
+   if (it->second.probe) probed_bucket = it->second.bucket_index;
+   ping_sent_.erase(it);
+  }
+
+  // node is alive, candidates stay in replacement cache
+  if (probed_bucket) {
+    auto& bucket = routing_table_.k_buckets_[*probed_bucket];
+    WriteGuard g(bucket.mux);
+    bucket.probing = false;
+  }
+
+  return std::chrono::duration_cast<std::chrono::milliseconds>(rtt);
 }
 } // namespace net
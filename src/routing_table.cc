@@ -1,7 +1,13 @@
 #include "routing_table.h"
 
 #include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
 #include <thread>
+#include <type_traits>
 
 #include "network.h"
 #include "utils/log.h"
@@ -11,54 +17,116 @@ namespace net {
 RoutingTable::RoutingTable(ba::io_context& io,
                            RoutingTableEventHandler& host)
     : host_data_(Network::Instance().GetHostContacts()),
-      socket_(UdpSocket<kMaxDatagramSize>::Create(io,
-          bi::udp::endpoint(host_data_.address, host_data_.udp_port),
-          static_cast<UdpSocketEventHandler&>(*this))),
       host_(host),
+      max_fragment_size_(std::max<size_t>(Network::Instance().GetConfig().max_fragment_size, 1)),
       io_(io),
       kBucketsNum(static_cast<uint16_t>(host_data_.id.size() * 8)), // num of bits in NodeId
-      k_buckets_(new KBucket[kBucketsNum]),
+      k_buckets_(new LockedBucket[kBucketsNum]),
       pinger_(*this),
-      explorer_(*this, Network::Instance().GetConfig().full_net_discovery),
+      explorer_(*this, Network::Instance().GetConfig().full_net_discovery,
+                Network::Instance().GetConfig().bucket_refresh_interval),
       collector_(*this) {
-  socket_->Open();
+  OpenSockets(Network::Instance().GetConfig().udp_shards);
+  SeedFromFile();
 
   pinger_.Start(pinger_stopper_.get_future());
   explorer_.Start(discovery_stopper_.get_future());
 }
 
 RoutingTable::~RoutingTable() {
-  Guard g(k_bucket_mux_);
-  delete []k_buckets_;
+  CloseSockets();
 }
 
 void RoutingTable::Stop() {
   pinger_stopper_.set_value();
   discovery_stopper_.set_value();
+  // discovery thread dumps table periodically, final dump must not overlap it
+  explorer_.Join();
+  DumpToFile();
   collector_.Stop();
 
-  socket_->Close();
+  for (auto& shard : shards_) {
+    auto& socket = shard->GetSocket();
+    LOG(DEBUG) << "UDP receive batches: " << Socket::HistogramToString(socket.GetRecvBatchHistogram());
+    LOG(DEBUG) << "UDP send batches: " << Socket::HistogramToString(socket.GetSendBatchHistogram());
+
+    for (auto p : {UdpDatagram::kHigh, UdpDatagram::kNormal}) {
+      auto& stats = socket.GetQueueStats(p);
+      LOG(DEBUG) << "UDP send queue " << static_cast<int>(p) << ": queued "
+                 << stats.queued << ", dropped " << stats.dropped;
+    }
+  }
+
+  CloseSockets();
+}
+
+RoutingTable::SocketShard::SocketShard(RoutingTable& rt, ba::io_context& io)
+    : routing_table_(rt),
+      socket_(Socket::Create(io,
+          bi::udp::endpoint(rt.host_data_.address, rt.host_data_.udp_port),
+          static_cast<UdpSocketEventHandler&>(*this))) {}
+
+void RoutingTable::OpenSockets(size_t shards_num) {
+#ifndef NET_UDP_REUSEPORT
+  if (shards_num > 1) {
+    LOG(INFO) << "UDP socket sharding is not supported on this platform.";
+    shards_num = 1;
+  }
+#endif
+  if (shards_num == 0) shards_num = 1;
+
+  shards_.push_back(std::make_unique<SocketShard>(*this, io_));
+  for (size_t i = 1; i < shards_num; ++i) {
+    shard_io_.push_back(std::make_unique<ba::io_context>(1));
+    shards_.push_back(std::make_unique<SocketShard>(*this, *shard_io_.back()));
+  }
+
+  for (auto& shard : shards_) {
+    shard->GetSocket().Open(shards_num > 1);
+  }
+
+  for (auto& io : shard_io_) {
+    shard_threads_.emplace_back([ctx = io.get()] { ctx->run(); });
+  }
+}
+
+void RoutingTable::CloseSockets() {
+  for (auto& shard : shards_) {
+    shard->GetSocket().Close();
+  }
+
+  for (auto& io : shard_io_) {
+    io->stop();
+  }
+
+  for (auto& t : shard_threads_) {
+    if (t.joinable()) t.join();
+  }
+  shard_threads_.clear();
 }
 
 void RoutingTable::AddNodes(const std::vector<NodeEntrance>& nodes) {
   if (total_nodes_.load() == 0) {
     explorer_.Find(host_data_.id, nodes);
   } else {
-    Guard g(k_bucket_mux_);
     for (auto& n : nodes) {
       if (n.id == host_data_.id) continue;
-      pinger_.SendPing(n, k_buckets_[KBucketIndex(n.id)]);
+      pinger_.SendPing(n, KBucketIndex(n.id));
     }
   }
 }
 
 bool RoutingTable::HasNode(const NodeId& id, NodeEntrance& result) {
-  Guard g(k_bucket_mux_);
-  return k_buckets_[KBucketIndex(id)].Get(id, result);
+  auto index = KBucketIndex(id);
+  if (index == kIvalidIndex) return false;
+
+  auto& bucket = k_buckets_[index];
+  SharedGuard g(bucket.mux);
+  return bucket.nodes.Get(id, result);
 }
 
 void RoutingTable::StartFindNode(const NodeId& id) {
-  explorer_.Find(id, NearestNodes(id));
+  explorer_.Find(id, NearestNodes(id, true));
 }
 
 void RoutingTable::GetKnownNodes(std::vector<NodeEntrance>& result) {
@@ -68,28 +136,28 @@ void RoutingTable::GetKnownNodes(std::vector<NodeEntrance>& result) {
     return explorer_.GetKnownNodes(result);
   }
 
-  Guard g(k_bucket_mux_);
   for (size_t i = 0; i < kBucketsNum; ++i) {
-    const auto& nodes = k_buckets_[i].GetNodes();
-    result.insert(result.end(), nodes.begin(), nodes.end());
+    SharedGuard g(k_buckets_[i].mux);
+    k_buckets_[i].nodes.ForEach([&result](const NodeEntrance& n) { result.push_back(n); });
   }
 }
 
+CrawlerStore::Cursor RoutingTable::GetKnownNodes(CrawlerStore::Cursor cursor, size_t limit,
+                                                 std::vector<NodeEntrance>& result) {
+  if (!Network::Instance().GetConfig().full_net_discovery) return cursor;
+  return explorer_.GetKnownNodes(cursor, limit, result);
+}
+
 std::vector<NodeEntrance> RoutingTable::GetBroadcastList(const NodeId& received_from) {
   std::vector<NodeEntrance> ret;
   int32_t index = KBucketIndex(received_from);
   if (index == kIvalidIndex) index = -1;
 
-  Guard g(k_bucket_mux_);
   for (int32_t i = kBucketsNum - 1; i > index; --i) {
-    if (!k_buckets_[i].Size()) continue;
+    SharedGuard g(k_buckets_[i].mux);
+    if (!k_buckets_[i].nodes.Size()) continue;
 
-    uint8_t added_in_subtree = 0;
-    auto& nodes = k_buckets_[i].GetNodes();
-    for (auto& n : nodes) {
-      ret.push_back(n);
-      if (++added_in_subtree == kBroadcastReplication) break;
-    }
+    k_buckets_[i].nodes.FastestNodes(kBroadcastReplication, ret);
   }
 
   return ret;
@@ -101,12 +169,12 @@ void RoutingTable::UpdateTcpPort(const NodeId& id, uint16_t port) {
 
   NodeEntrance contacts;
 
-  Guard g(k_bucket_mux_);
   auto& bucket = k_buckets_[index];
+  WriteGuard g(bucket.mux);
 
-  if (bucket.Get(id, contacts) && port != contacts.tcp_port) {
+  if (bucket.nodes.Get(id, contacts) && port != contacts.tcp_port) {
     contacts.tcp_port = port;
-    bucket.Update(contacts);
+    bucket.nodes.Update(contacts);
   }
 }
 
@@ -118,47 +186,64 @@ void RoutingTable::StoreFragment(const FragmentId& id, ByteVector&& fragment) {
   collector_.StoreFragment(id, std::move(fragment));
 }
 
-void RoutingTable::OnPacketReceived(const bi::udp::endpoint& from, const ByteVector& data) {
+void RoutingTable::OnPacketReceived(const bi::udp::endpoint& from, ByteView data, Socket& socket) {
   if (host_.IsEndpointBanned(from.address(), from.port())) return;
 
-  auto packet = KademliaDatagram::ReinterpretUdpPacket(from, data);
+  auto packet = ReinterpretUdpPacket(from, data);
   if (!packet) return;
 
-  if (!CheckEndpoint(*packet)) {
+  const KademliaDatagram& base = std::visit(
+      [](const KademliaDatagram& d) -> const KademliaDatagram& { return d; }, *packet);
+
+  if (!CheckEndpoint(base)) {
     LOG(DEBUG) << "Endpoint check failed from " << from.address() << ", " << from.port();
     return;
   }
 
-  switch (packet->DatagramType()) {
-    case PingDatagram::type :
-      HandlePing(*packet);
-      break;
-    case PingRespDatagram::type :
-      pinger_.CheckPingResponce(*packet);
-      break;
-    case FindNodeDatagram::type :
-      HandleFindNode(*packet);
-      break;
-    case FindNodeRespDatagram::type :
-      explorer_.CheckFindNodeResponce(*packet);
-      break;
-    case FindFragmentDatagram::type :
-      collector_.HandleFindFragment(*packet);
-      break;
-    case FragmentFoundDatagram::type :
-      collector_.HandleFragmentFound(*packet);
-      break;
-    case FragmentNotFoundDatagram::type :
-      collector_.HandleFragmentNotFound(*packet);
-      break;
-    case StoreDatagram::type :
-      collector_.HandleStoreFragment(*packet);
-      break;
-    default :
-      break;
-  }
+  std::optional<std::chrono::milliseconds> rtt;
+
+  std::visit([this, &socket, &rtt](auto& d) {
+               using T = std::decay_t<decltype(d)>;
+
+               if constexpr (std::is_same_v<T, PingDatagram>) {
+                 HandlePing(d, socket);
+               } else if constexpr (std::is_same_v<T, PingRespDatagram>) {
+                 rtt = pinger_.CheckPingResponce(d);
+               } else if constexpr (std::is_same_v<T, FindNodeDatagram>) {
+                 HandleFindNode(d, socket);
+               } else if constexpr (std::is_same_v<T, FindNodeRespDatagram>) {
+                 rtt = explorer_.CheckFindNodeResponce(d);
+               } else if constexpr (std::is_same_v<T, FindFragmentDatagram>) {
+                 collector_.HandleFindFragment(d, socket);
+               } else if constexpr (std::is_same_v<T, FragmentNotFoundDatagram>) {
+                 collector_.HandleFragmentNotFound(d);
+               }
+               // fragments are accepted over tcp only
+             }, *packet);
+
+  UpdateKBuckets(base.node_from);
+  if (rtt) UpdateRtt(base.node_from.id, *rtt);
+}
+
+void RoutingTable::OnFragmentDatagram(const NodeId& sender, ByteView data) {
+  // no udp endpoint here, node_from contacts are not used
+  auto packet = ReinterpretUdpPacket(bi::udp::endpoint(), data);
+  if (!packet) return;
+
+  std::visit([this, &sender](auto& d) {
+               using T = std::decay_t<decltype(d)>;
+
+               if (d.node_from.id != sender) {
+                 LOG(DEBUG) << "Fragment datagram sender mismatch " << IdToBase58(sender);
+                 return;
+               }
 
-  UpdateKBuckets(packet->node_from);
+               if constexpr (std::is_same_v<T, FragmentFoundDatagram>) {
+                 collector_.HandleFragmentFound(d);
+               } else if constexpr (std::is_same_v<T, StoreDatagram>) {
+                 collector_.HandleStoreFragment(d);
+               }
+             }, *packet);
 }
 
 bool RoutingTable::CheckEndpoint(const KademliaDatagram& d) {
@@ -174,17 +259,16 @@ bool RoutingTable::CheckEndpoint(const KademliaDatagram& d) {
          node_from.udp_port == existing_contacts.udp_port;
 }
 
-void RoutingTable::HandlePing(const KademliaDatagram& d) {
+void RoutingTable::HandlePing(const PingDatagram& d, Socket& socket) {
   PingRespDatagram answer(host_data_);
-  socket_->Send(answer.ToUdp(d.node_from));
+  socket.Send(answer.ToUdp(d.node_from));
 }
 
-void RoutingTable::HandleFindNode(const KademliaDatagram& d) {
-  auto& find_node = dynamic_cast<const FindNodeDatagram&>(d);
+void RoutingTable::HandleFindNode(const FindNodeDatagram& find_node, Socket& socket) {
   auto requested_nodes = NearestNodes(find_node.target);
 
   FindNodeRespDatagram answer(host_data_, find_node.target, std::move(requested_nodes));
-  socket_->Send(answer.ToUdp(d.node_from));
+  socket.Send(answer.ToUdp(find_node.node_from));
 }
 
 void RoutingTable::UpdateKBuckets(const std::vector<NodeEntrance>& nodes) {
@@ -196,66 +280,225 @@ void RoutingTable::UpdateKBuckets(const std::vector<NodeEntrance>& nodes) {
 void RoutingTable::UpdateKBuckets(const NodeEntrance& node) {
   if (node.id == host_data_.id) return;
 
-  Guard g(k_bucket_mux_);
-  KBucket& bucket = k_buckets_[KBucketIndex(node.id)];
-  if (bucket.Exists(node.id)) {
-    bucket.Promote(node.id);
-  } else if (bucket.Size() < k) {
-    bucket.AddNode(node);
+  auto index = KBucketIndex(node.id);
+  auto& bucket = k_buckets_[index];
+
+  WriteGuard g(bucket.mux);
+  if (bucket.nodes.Exists(node.id)) {
+    bucket.nodes.Promote(node.id);
+  } else if (bucket.nodes.Size() < k && bucket.nodes.AddNode(node)) {
     ++total_nodes_;
     NotifyHost(node, RoutingTableEventType::kNodeAdded);
   } else {
-    pinger_.SendPing(bucket.LeastRecentlySeen(), bucket, std::make_shared<NodeEntrance>(node));
+    bucket.nodes.AddReplacement(node);
+    if (bucket.probing) return;
+
+    // recently seen nodes are alive, no need to check them
+    NodeEntrance to_probe;
+    if (!bucket.nodes.EvictionCandidate(std::chrono::system_clock::now() - kIdleBeforePing, to_probe)) return;
+
+    bucket.probing = true;
+    pinger_.SendPing(to_probe, index, true);
   }
 }
 
-std::vector<NodeEntrance> RoutingTable::NearestNodes(const NodeId& target) {
-  auto comparator = [](const std::pair<uint16_t, NodeEntrance>& n1,
-                       const std::pair<uint16_t, NodeEntrance>& n2) {
-    return n1.first > n2.first;
-  };
+void RoutingTable::OnNodeSeen(const NodeId& id) {
+  auto index = KBucketIndex(id);
+  if (index == kIvalidIndex) return;
+
+  auto& bucket = k_buckets_[index];
+  WriteGuard g(bucket.mux);
+  bucket.nodes.Promote(id);
+}
+
+void RoutingTable::UpdateRtt(const NodeId& id, std::chrono::milliseconds rtt) {
+  auto index = KBucketIndex(id);
+  if (index == kIvalidIndex) return;
 
-  std::multiset<std::pair<uint16_t, NodeEntrance>, decltype(comparator)>
-      nearest_nodes(comparator);
+  auto& bucket = k_buckets_[index];
+  WriteGuard g(bucket.mux);
+  bucket.nodes.AddRttSample(id, static_cast<uint32_t>(std::max<std::chrono::milliseconds::rep>(rtt.count(), 1)));
+}
 
+uint32_t RoutingTable::GetRttKey(const NodeId& id) const {
+  KBucket::NodeInfo info;
+
+  auto index = KBucketIndex(id);
+  if (index != kIvalidIndex) {
+    auto& bucket = k_buckets_[index];
+    SharedGuard g(bucket.mux);
+    bucket.nodes.GetInfo(id, info);
+  }
+
+  return info.RttKey();
+}
+
+void RoutingTable::DumpToFile() {
+  Serializer entries;
+  uint64_t count = 0;
+
+  for (size_t i = 0; i < kBucketsNum; ++i) {
+    SharedGuard g(k_buckets_[i].mux);
+    k_buckets_[i].nodes.ForEachWithInfo([&entries, &count](const NodeEntrance& node, const KBucket::NodeInfo& info) {
+      using namespace std::chrono;
+      node.Put(entries);
+      entries.PutVarint(duration_cast<seconds>(info.last_seen.time_since_epoch()).count());
+      entries.PutVarint(info.rtt_ms);
+      ++count;
+    });
+  }
+
+  // table which has not warmed up yet doesn't replace saved one
+  if (!count) return;
+
+  Serializer s;
+  s.Put(kRoutingTableFileVersion);
+  s.PutVarint(count);
+  auto& data = entries.GetData();
+  s.Put(data.data(), data.size());
+
+  // written to temporary file and renamed,
+  // so that crash during dump doesn't corrupt saved table
+  std::string tmp_path = std::string(kRoutingTableFileName) + ".tmp";
   {
-   Guard g(k_bucket_mux_);
-   for (size_t i = 0; i < kBucketsNum; ++i) {
-     auto& nodes = k_buckets_[i].GetNodes();
-     std::for_each(nodes.begin(), nodes.end(),
-                     [&nearest_nodes, &target](const NodeEntrance& node) {
-                       nearest_nodes.insert(
-                         std::make_pair(RoutingTable::KBucketIndex(target, node.id), node));
-
-                       if (nearest_nodes.size() > k) {
-                         nearest_nodes.erase(--nearest_nodes.end());
-                       }
-                     });
-   }
+   std::ofstream f(tmp_path, std::ios::binary | std::ios::trunc);
+   if (!f.is_open()) return;
+   f.write(reinterpret_cast<const char*>(s.GetData().data()), s.GetData().size());
+   if (!f) return;
+  }
+  if (std::rename(tmp_path.c_str(), kRoutingTableFileName) != 0) {
+    LOG(ERROR) << "Cannot replace " << kRoutingTableFileName << ": " << std::strerror(errno);
+    std::remove(tmp_path.c_str());
+  }
+}
+
+void RoutingTable::SeedFromFile() {
+  std::ifstream f(kRoutingTableFileName, std::ios::binary);
+  if (!f.is_open()) return;
+
+  ByteVector data((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+  Unserializer u(data.data(), data.size());
+
+  uint8_t version;
+  uint64_t count;
+  if (!u.Get(version) || version != kRoutingTableFileVersion || !u.GetVarint(count)) return;
+
+  auto now = std::chrono::system_clock::now();
+  std::vector<std::pair<uint64_t, NodeEntrance>> saved;
+
+  for (uint64_t i = 0; i < count; ++i) {
+    NodeEntrance node;
+    uint64_t last_seen, rtt_ms;
+    if (!node.Get(u) || !u.GetVarint(last_seen) || !u.GetVarint(rtt_ms)) break;
+
+    if (node.id == host_data_.id) continue;
+    if (now - std::chrono::system_clock::time_point(std::chrono::seconds(last_seen)) > kMaxSavedNodeAge) continue;
+
+    // not measured rtt goes last
+    saved.emplace_back(rtt_ms ? rtt_ms : std::numeric_limits<uint64_t>::max(), std::move(node));
+  }
+
+  std::stable_sort(saved.begin(), saved.end(),
+                   [](const auto& l, const auto& r) { return l.first < r.first; });
+
+  // All pings are sent at once, fastest nodes first,
+  // node is added to its bucket when it answers.
+  for (auto& s : saved) {
+    pinger_.SendPing(s.second, KBucketIndex(s.second.id));
   }
 
+  LOG(DEBUG) << "Routing table seeded from file, nodes pinged " << saved.size();
+}
+
+std::vector<NodeEntrance> RoutingTable::NearestNodes(const NodeId& target, bool include_known) {
+  // Buckets are visited in order of distance class from target:
+  // target's bucket b, buckets deeper than b (all of them share leading
+  // distance bit b), then b - 1 down to 0. Node from earlier class is always
+  // closer, so scan stops when k nodes are collected after whole class.
+  // Buckets are locked one by one, so contacts are copied.
+  using Candidate = std::pair<DistanceKey, NodeEntrance>;
+  thread_local std::vector<Candidate> candidates;
+  candidates.clear();
+
+  auto collect = [this, &target](size_t i) {
+    auto& bucket = k_buckets_[i].nodes;
+    std::array<DistanceKey, KBucket::kCapacity> distances;
+
+    SharedGuard g(k_buckets_[i].mux);
+    XorDistances(target, bucket.Ids(), bucket.Size(), distances.data());
+    for (size_t slot = 0; slot < bucket.Size(); ++slot) {
+      candidates.emplace_back(distances[slot], bucket.Contact(slot));
+    }
+  };
+
   std::vector<NodeEntrance> ret;
-  for (auto& n : nearest_nodes) {
-    ret.emplace_back(std::move(n.second));
+  auto b = std::min(KBucketIndex(target), kBucketsNum);
+
+  if (b < kBucketsNum) {
+    collect(b);
+  }
+
+  if (candidates.size() < k) {
+    for (size_t i = b + 1; i < kBucketsNum; ++i) {
+      collect(i);
+    }
+  }
+
+  for (size_t i = b; i-- > 0 && candidates.size() < k;) {
+    collect(i);
+  }
+
+  auto by_distance = [](const Candidate& l, const Candidate& r) { return l.first < r.first; };
+
+  if (include_known && Network::Instance().GetConfig().full_net_discovery) {
+    thread_local std::vector<NodeEntrance> known;
+    known.clear();
+    explorer_.GetClosestKnownNodes(target, k + 1, known);
+
+    for (auto& n : known) {
+      if (n.id == host_data_.id) continue;
+      candidates.emplace_back(XorDistance(target, n.id), std::move(n));
+    }
+
+    // node may be both in k-bucket and in known nodes, k-bucket contacts win
+    std::stable_sort(candidates.begin(), candidates.end(), by_distance);
+    candidates.erase(std::unique(candidates.begin(), candidates.end(),
+                                 [](const Candidate& l, const Candidate& r) { return l.first == r.first; }),
+                     candidates.end());
+  }
+
+  auto n = std::min<size_t>(k, candidates.size());
+  std::partial_sort(candidates.begin(), candidates.begin() + n, candidates.end(), by_distance);
+
+  ret.reserve(n);
+  for (size_t i = 0; i < n; ++i) {
+    ret.push_back(std::move(candidates[i].second));
   }
   return ret;
 }
 
-void RoutingTable::OnNodeFound(const NodeEntrance& node) {
+void RoutingTable::OnNodeFound(const NodeEntrance& node, std::vector<NodeEntrance>&& closest) {
   if (node.id == host_data_.id) return;
-  NotifyHost(node, RoutingTableEventType::kNodeFound);
+
+  ba::post(io_, [this, node, closest = std::move(closest)]() mutable {
+    host_.HandleRoutTableEvent(node, RoutingTableEventType::kNodeFound);
+    host_.OnLookupFinished(node.id, node, std::move(closest));
+  });
 }
 
-void RoutingTable::OnNodeNotFound(const NodeId& id) {
+void RoutingTable::OnNodeNotFound(const NodeId& id, std::vector<NodeEntrance>&& closest) {
   NodeEntrance node;
   node.id = id;
-  NotifyHost(node, RoutingTableEventType::kNodeNotFound);
+
+  ba::post(io_, [this, node, closest = std::move(closest)]() mutable {
+    host_.HandleRoutTableEvent(node, RoutingTableEventType::kNodeNotFound);
+    host_.OnLookupFinished(node.id, std::nullopt, std::move(closest));
+  });
 }
 
 void RoutingTable::NotifyHost(const NodeEntrance& node, RoutingTableEventType event) {
-  std::thread t([this, node, event]() {
-                  host_.HandleRoutTableEvent(node, event);
-                });
-  t.detach();
+  ba::post(io_, [this, node, event] {
+    host_.HandleRoutTableEvent(node, event);
+  });
 }
 } // namespace net
@@ -7,16 +7,20 @@
 #include <future>
 #include <limits>
 #include <list>
+#include <optional>
+#include <random>
 #include <unordered_map>
 #include <unordered_set>
 #include <thread>
 #include <vector>
 
 #include "common.h"
+#include "crawler_store.h"
 #include "database.h"
 #include "k_bucket.h"
 #include "kademlia_datagram.h"
 #include "udp.h"
+#include "utils/distance.h"
 
 namespace net {
 
@@ -27,7 +31,8 @@ enum class RoutingTableEventType {
   kNodeNotFound
 };
 
-// Routing table's owner must implement this interface
+// Routing table's owner must implement this interface,
+// events and lookup results are delivered from io thread.
 class RoutingTableEventHandler {
  public:
   virtual ~RoutingTableEventHandler() = default;
@@ -35,12 +40,21 @@ class RoutingTableEventHandler {
   virtual bool IsEndpointBanned(const bi::address& addr, uint16_t port) = 0;
   virtual void OnFragmentFound(const FragmentId& id, ByteVector&& fragment) = 0;
   virtual void OnFragmentNotFound(const FragmentId& id) = 0;
+
+  // Called after kNodeFound or kNodeNotFound event of lookup,
+  // closest are nodes which answered during lookup, nearest first.
+  virtual void OnLookupFinished(const NodeId& target, const std::optional<NodeEntrance>& found,
+                                std::vector<NodeEntrance>&& closest) = 0;
+
+  // Fragments are too big for udp, so Store and FragmentFound
+  // datagrams are delivered by owner over tcp.
+  virtual void SendFragmentDatagram(const NodeEntrance& to, ByteVector&& datagram) = 0;
 };
 
-class RoutingTable : public UdpSocketEventHandler {
+class RoutingTable {
  public:
   RoutingTable(ba::io_context& io, RoutingTableEventHandler& host);
-  ~RoutingTable() override;
+  ~RoutingTable();
 
   void Stop();
 
@@ -51,33 +65,37 @@ class RoutingTable : public UdpSocketEventHandler {
   void StartFindNode(const NodeId&);
 
   void GetKnownNodes(std::vector<NodeEntrance>&);
+  // paged export of nodes collected in full net discovery mode
+  CrawlerStore::Cursor GetKnownNodes(CrawlerStore::Cursor, size_t limit, std::vector<NodeEntrance>&);
 
   std::vector<NodeEntrance> GetBroadcastList(const NodeId&);
 
-  static constexpr auto GetMaxFragmentSize() { return kMaxFragmentSize; }
+  size_t GetMaxFragmentSize() const noexcept { return max_fragment_size_; }
   void StoreFragment(const FragmentId&, ByteVector&&);
   void FindFragment(const FragmentId&);
 
+  // Datagram received over tcp, sender is the peer connection is registered with.
+  void OnFragmentDatagram(const NodeId& sender, ByteView data);
+
   void UpdateTcpPort(const NodeId&, uint16_t port);
+  // refreshes last seen time of node if it is in routing table,
+  // owner calls it with remote id of connection on each accepted tcp frame
+  void OnNodeSeen(const NodeId&);
 
   static NodeId Distance(const NodeId&, const NodeId&);
   static uint16_t KBucketIndex(const NodeId& target, const NodeId& id);
 
   static constexpr uint16_t kIvalidIndex = std::numeric_limits<uint16_t>::max();
 
- protected:
-  void OnSocketClosed(const boost::system::error_code&) override {}
-
-  void OnPacketReceived(const bi::udp::endpoint& from,
-                        const ByteVector& data) override;
-
  private:
   static constexpr uint16_t kMaxDatagramSize = 1472; // 1500(ethernet payload) - 20(ip header) - 8(udp header)
-  static constexpr uint16_t kMaxFragmentSize = 1350;
+
+  using Socket = UdpSocket<kMaxDatagramSize>;
 
   // k should be chosen such that any given k nodes
   // are very unlikely to fail within an hour of each other
   static constexpr uint8_t k = 16;
+  static_assert(k <= KBucket::kCapacity, "k-bucket can't hold k nodes");
 
   // if kBroadcastReplication == k, topology based broadcast becomes flooding;
   // if it equals to 1, it takes logN time to spread a message through network
@@ -87,65 +105,147 @@ class RoutingTable : public UdpSocketEventHandler {
   static constexpr uint8_t kMaxPingsBeforeRemove = 3;
   static constexpr std::chrono::seconds kPingExpirationSeconds{8};
 
+  // Any datagram or tcp frame from node refreshes its last seen time,
+  // only nodes idle longer than kIdleBeforePing are pinged.
+  static constexpr std::chrono::seconds kIdleBeforePing{60};
+  static constexpr std::chrono::seconds kPingRoutineInterval{1};
+  static constexpr size_t kMaxIdlePingsPerInterval = 16;
+
   static constexpr std::chrono::seconds kDiscoveryInterval{60};
   static constexpr std::chrono::seconds kDiscoveryExpirationSeconds{30};
 
+  static constexpr uint8_t kRoutingTableFileVersion = 1;
+  static constexpr std::chrono::minutes kDumpInterval{5};
+  static constexpr std::chrono::hours kMaxSavedNodeAge{24};
+
+  // Replies are sent through the socket which received request.
+  void OnPacketReceived(const bi::udp::endpoint& from, ByteView data, Socket&);
+
   bool CheckEndpoint(const KademliaDatagram&);
 
-  void HandlePing(const KademliaDatagram&);
-  void HandleFindNode(const KademliaDatagram&);
+  void HandlePing(const PingDatagram&, Socket&);
+  void HandleFindNode(const FindNodeDatagram&, Socket&);
+
+  // Socket for new requests, shards are used in turn.
+  Socket& GetSocket() noexcept;
+
+  void OpenSockets(size_t shards_num);
+  void CloseSockets();
 
   uint16_t KBucketIndex(const NodeId& id) const noexcept;
 
   void UpdateKBuckets(const NodeEntrance&);
   void UpdateKBuckets(const std::vector<NodeEntrance>&);
+  void UpdateRtt(const NodeId&, std::chrono::milliseconds);
+  // KBucket::NodeInfo::RttKey of node, unknown nodes are the slowest
+  uint32_t GetRttKey(const NodeId&) const;
 
-  void OnNodeFound(const NodeEntrance&);
-  void OnNodeNotFound(const NodeId&);
+  // Routing table is saved periodically and on stop,
+  // saved nodes are pinged on start to warm table up.
+  void DumpToFile();
+  void SeedFromFile();
+
+  void OnNodeFound(const NodeEntrance&, std::vector<NodeEntrance>&& closest);
+  void OnNodeNotFound(const NodeId&, std::vector<NodeEntrance>&& closest);
 
   void NotifyHost(const NodeEntrance& node, RoutingTableEventType);
 
   // Returns k closest nodes to target id.
   // Or total_nodes_ nodes if total_nodes_ < k.
-  std::vector<NodeEntrance> NearestNodes(const NodeId&);
+  // With include_known in full net discovery mode known nodes out of k-buckets
+  // are considered too. They are not verified, so use it only to start own
+  // lookups and fragment searches, never for stores or remote requests.
+  std::vector<NodeEntrance> NearestNodes(const NodeId&, bool include_known = false);
+
+  // Datagram is encoded once for all destinations.
+  template<class Datagram>
+  void SendToSocket(const Datagram&, const std::vector<NodeEntrance>& dest_nodes);
 
-  template<class KademliaDatagram>
-  void SendToSocket(KademliaDatagram&&, const std::vector<NodeEntrance>& dest_nodes);
+  // Datagrams with fragments are sent over tcp by host_, each packet owns
+  // its copy of encoded datagram, the last destination takes the original.
+  template<class Datagram>
+  void SendToHost(const Datagram&, const std::vector<NodeEntrance>& dest_nodes);
 
   class NetExplorer {
    public:
-    NetExplorer(RoutingTable&, bool full_discovery);
+    NetExplorer(RoutingTable&, bool full_discovery, std::chrono::seconds refresh_interval);
     ~NetExplorer();
 
     void Start(std::future<void>&& stop_condition);
+    // waits for discovery thread after stop condition is set
+    void Join();
     void Find(const NodeId&, const std::vector<NodeEntrance>& find_list);
-    void CheckFindNodeResponce(const KademliaDatagram&);
+    // returns round trip time if request was sent by us
+    std::optional<std::chrono::milliseconds> CheckFindNodeResponce(const FindNodeRespDatagram&);
     void GetKnownNodes(std::vector<NodeEntrance>&);
+    CrawlerStore::Cursor GetKnownNodes(CrawlerStore::Cursor, size_t limit, std::vector<NodeEntrance>&);
+    void GetClosestKnownNodes(const NodeId& target, size_t k, std::vector<NodeEntrance>&);
 
    private:
+    // Iterative lookup: at most kAlpha queries in flight to the closest
+    // not queried nodes of shortlist, it ends when target is found
+    // or when k closest alive nodes of shortlist have answered.
+    struct Lookup {
+      enum class State : uint8_t {
+        kNotQueried,
+        kInFlight,
+        kAnswered,
+        kFailed
+      };
+
+      struct Candidate {
+        DistanceKey distance;
+        NodeEntrance node;
+        State state;
+        uint32_t rtt_key;
+        std::chrono::steady_clock::time_point sent;
+      };
+
+      std::vector<Candidate> shortlist; // sorted by distance
+      std::unordered_set<NodeId> seen;
+      uint64_t generation = 0; // tells timers of previous lookups of same target
+      uint8_t in_flight = 0;
+      uint32_t queries = 0;
+      std::chrono::steady_clock::time_point started;
+    };
+
+    using Lookups = std::unordered_map<NodeId, Lookup>;
+
+    // all methods below expect find_node_mux_ to be locked
+    void AddCandidates(const NodeId& target, Lookup&, const std::vector<NodeEntrance>&);
+    // returns false if lookup has converged
+    bool Advance(const NodeId& target, Lookup&);
+    void StartQueryTimer(const NodeId& target, const NodeId& node, uint64_t generation);
+    void Finish(Lookups::iterator, const NodeEntrance* found);
+
     void DiscoveryRoutine(std::future<void>&&);
+    // starts lookups in buckets without lookups for refresh_interval_
+    void RefreshStaleBuckets(std::mt19937&);
     void UpdateNodes();
     void UpdateNodes(const std::vector<NodeEntrance>&);
 
+    static constexpr uint8_t kAlpha = 3;
+    static constexpr std::chrono::milliseconds kFindNodeTimeout{1000};
+    // shortlist tail beyond this is dropped
+    static constexpr size_t kMaxShortlistSize = 4 * k;
+    static constexpr size_t kMaxRefreshesPerRound = 8;
+
     RoutingTable& routing_table_;
     const bool full_discovery_;
     std::thread discovery_thread_;
 
     Mutex find_node_mux_;
-    std::unordered_map<NodeId, std::vector<NodeId>> find_node_sent_;
+    Lookups lookups_;
+    uint64_t next_generation_ = 0;
 
-    static constexpr std::chrono::seconds kUpdateNodesInterval{60 * 10};
-    Mutex nodes_mux_;
-    struct Nodes {
-      struct NodeEqual {
-        bool operator()(const NodeEntrance& l, const NodeEntrance& r) const {
-          return l.id == r.id;
-        }
-      };
+    const std::chrono::seconds refresh_interval_;
+    // time of last lookup into each bucket's range, guarded by find_node_mux_
+    std::vector<std::chrono::steady_clock::time_point> bucket_lookups_;
 
-      std::unordered_set<NodeEntrance, std::hash<NodeEntrance>, NodeEqual> actual;
-      std::unordered_set<NodeEntrance, std::hash<NodeEntrance>, NodeEqual> updates;
-    } nodes_;
+    // nodes not seen for this time are dropped from known nodes
+    static constexpr std::chrono::seconds kKnownNodeMaxAge{60 * 20};
+    Mutex nodes_mux_;
+    CrawlerStore known_nodes_;
   };
 
   class Pinger {
@@ -154,18 +254,37 @@ class RoutingTable : public UdpSocketEventHandler {
     ~Pinger();
 
     void Start(std::future<void>&& stop_condition);
-    void SendPing(const NodeEntrance& target, KBucket& bucket,
-                  std::shared_ptr<NodeEntrance> replacer = nullptr);
-    void CheckPingResponce(const KademliaDatagram&);
+    // Does nothing if target is already pinged, except marking it as probe.
+    // Probe is an eviction check of full bucket's least recently seen node,
+    // it is sent once and bucket's probing flag is cleared on its result.
+    void SendPing(const NodeEntrance& target, uint16_t bucket_index, bool probe = false);
+    // returns round trip time if ping was sent by us
+    std::optional<std::chrono::milliseconds> CheckPingResponce(const PingRespDatagram&);
 
    private:
     void PingRoutine(std::future<void>&&);
+    // resends expired pings, evicts nodes which have not answered
+    void CheckExpiredPings();
+    // pings at most kMaxIdlePingsPerInterval idle nodes, buckets are visited in turn
+    void PingIdleNodes();
+    // replaces target with node from bucket's replacement cache
+    void Evict(const NodeEntrance& target, uint16_t bucket_index, bool probe);
 
     RoutingTable& routing_table_;
     std::thread ping_thread_;
+    uint16_t current_bucket_ = 0;
 
+    struct PingState {
+      NodeEntrance target;
+      uint16_t bucket_index;
+      bool probe;
+      uint8_t attempts;
+      std::chrono::steady_clock::time_point sent;
+    };
+
+    // may be locked under k-bucket's mux, not vice versa
     Mutex ping_mux_;
-    std::unordered_map<NodeId, uint8_t> ping_sent_;
+    std::unordered_map<NodeId, PingState> ping_sent_;
   };
 
   class FragmentCollector {
@@ -176,10 +295,10 @@ class RoutingTable : public UdpSocketEventHandler {
     void FindFragment(const FragmentId&);
     bool StoreFragment(const FragmentId&, ByteVector&&, bool remove_own = false);
 
-    void HandleFindFragment(const KademliaDatagram&);
-    void HandleStoreFragment(const KademliaDatagram&);
-    void HandleFragmentFound(KademliaDatagram&);
-    void HandleFragmentNotFound(const KademliaDatagram&);
+    void HandleFindFragment(const FindFragmentDatagram&, Socket&);
+    void HandleStoreFragment(const StoreDatagram&);
+    void HandleFragmentFound(FragmentFoundDatagram&);
+    void HandleFragmentNotFound(const FragmentNotFoundDatagram&);
 
    private:
     void AddToRequired(const FragmentId&);
@@ -194,6 +313,7 @@ class RoutingTable : public UdpSocketEventHandler {
     void StoreInDb(const FragmentId&, const ByteVector&);
     void RemoveFromDb(const FragmentId&);
     void ReplicationRoutine();
+    void MigrateDb();
 
     static constexpr std::chrono::seconds kReplicationInterval{60 * 60};
 
@@ -216,15 +336,45 @@ class RoutingTable : public UdpSocketEventHandler {
     std::unordered_map<FragmentId, std::chrono::steady_clock::time_point> stored_fragments_;
   };
 
+  // One of SO_REUSEPORT sockets bound to the same port.
+  class SocketShard : public UdpSocketEventHandler {
+   public:
+    SocketShard(RoutingTable&, ba::io_context&);
+
+    Socket& GetSocket() noexcept { return *socket_; }
+
+   protected:
+    void OnSocketClosed(const boost::system::error_code&) override {}
+    void OnPacketReceived(const bi::udp::endpoint& from, ByteView data) override {
+      routing_table_.OnPacketReceived(from, data, *socket_);
+    }
+
+   private:
+    RoutingTable& routing_table_;
+    Socket::Ptr socket_;
+  };
+
   const NodeEntrance host_data_;
-  UdpSocket<kMaxDatagramSize>::Ptr socket_;
   RoutingTableEventHandler& host_;
+  const size_t max_fragment_size_;
 
   ba::io_context& io_;
 
+  // First shard is served by io_, others by own threads.
+  std::vector<std::unique_ptr<ba::io_context>> shard_io_;
+  std::vector<std::unique_ptr<SocketShard>> shards_;
+  std::vector<std::thread> shard_threads_;
+  std::atomic<size_t> next_shard_{0};
+
   const uint16_t kBucketsNum;
-  Mutex k_bucket_mux_;
-  KBucket* k_buckets_;
+  // Each bucket has own lock, readers share it,
+  // so only writers of the same bucket block each other.
+  struct LockedBucket {
+    mutable SharedMutex mux;
+    KBucket nodes;
+    bool probing = false; // at most one eviction probe per bucket
+  };
+  std::unique_ptr<LockedBucket[]> k_buckets_;
   std::atomic<size_t> total_nodes_{0};
 
   Pinger pinger_;
@@ -244,17 +394,34 @@ inline uint16_t RoutingTable::KBucketIndex(const NodeId& id) const noexcept {
 }
 
 inline uint16_t RoutingTable::KBucketIndex(const NodeId& target, const NodeId& id) {
-  static size_t max_id_bits = id.size() * 8;
+  auto clz = XorClz(target, id);
+  return clz == kIdBits ? kIvalidIndex : clz;
+}
 
-  auto clz = Distance(target, id).GetCLZ();
-  return clz == max_id_bits ? kIvalidIndex : clz;
+inline RoutingTable::Socket& RoutingTable::GetSocket() noexcept {
+  if (shards_.size() == 1) return shards_.front()->GetSocket();
+  return shards_[next_shard_++ % shards_.size()]->GetSocket();
 }
 
-template<class KademliaDatagram>
-void RoutingTable::SendToSocket(KademliaDatagram&& d, const std::vector<NodeEntrance>& nodes) {
+template<class Datagram>
+void RoutingTable::SendToSocket(const Datagram& d, const std::vector<NodeEntrance>& nodes) {
+  if (nodes.empty()) return;
+
+  auto payload = Encode(d);
   for (auto& dest : nodes) {
-    socket_->Send(d.ToUdp(dest));
+    GetSocket().Send(KademliaDatagram::ToUdp(dest, payload, Datagram::type));
+  }
+}
+
+template<class Datagram>
+void RoutingTable::SendToHost(const Datagram& d, const std::vector<NodeEntrance>& nodes) {
+  if (nodes.empty()) return;
+
+  auto payload = EncodeBytes(d);
+  for (size_t i = 0; i + 1 < nodes.size(); ++i) {
+    host_.SendFragmentDatagram(nodes[i], ByteVector(payload));
   }
+  host_.SendFragmentDatagram(nodes.back(), std::move(payload));
 }
 
 } // namespace net
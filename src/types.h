@@ -3,7 +3,9 @@
 
 #include <array>
 #include <cinttypes>
+#include <cstddef>
 #include <mutex>
+#include <shared_mutex>
 
 namespace net {
 
@@ -14,5 +16,26 @@ using Mutex = std::mutex;
 using Guard = std::lock_guard<Mutex>;
 using UniqueGuard = std::unique_lock<Mutex>;
 
+using SharedMutex = std::shared_mutex;
+using SharedGuard = std::shared_lock<SharedMutex>;
+using WriteGuard = std::lock_guard<SharedMutex>;
+
+// Non owning view of received bytes, valid only inside of callback.
+class ByteView {
+ public:
+  ByteView(const uint8_t* data, size_t size) noexcept : data_(data), size_(size) {}
+
+  const uint8_t* data() const noexcept { return data_; }
+  size_t size() const noexcept { return size_; }
+  bool empty() const noexcept { return size_ == 0; }
+
+  const uint8_t* begin() const noexcept { return data_; }
+  const uint8_t* end() const noexcept { return data_ + size_; }
+
+ private:
+  const uint8_t* data_;
+  size_t size_;
+};
+
 } // namespace net
 #endif // NET_TYPES_H
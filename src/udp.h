@@ -1,11 +1,23 @@
 #ifndef NET_UDP_H
 #define NET_UDP_H
 
+#include <array>
 #include <atomic>
 #include <deque>
 #include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
 #include <utility>
 
+#if defined(__linux__)
+#define NET_UDP_MMSG
+#define NET_UDP_REUSEPORT
+#include <sys/socket.h>
+#include <cerrno>
+#include <cstring>
+#endif
+
 #include "common.h"
 #include "types.h"
 #include "utils/log.h"
@@ -14,23 +26,123 @@ namespace net {
 
 class UdpDatagram {
  public:
+  // Send order, high priority datagrams always go first.
+  enum Priority : uint8_t {
+    kHigh,
+    kNormal,
+    kPrioritiesNum
+  };
+
+  // Payload may be shared between datagrams to different endpoints.
+  UdpDatagram(const bi::udp::endpoint& ep,
+              std::shared_ptr<const ByteVector> data,
+              Priority priority = kNormal)
+      : ep_(ep), data_(std::move(data)), priority_(priority) {}
+
   UdpDatagram(const bi::udp::endpoint& ep,
-              ByteVector data = {}) : ep_(ep), data_(std::move(data)) {}
+              ByteVector data = {},
+              Priority priority = kNormal)
+      : UdpDatagram(ep, std::make_shared<const ByteVector>(std::move(data)), priority) {}
 
-  auto& Data() noexcept { return data_; }
-  const auto& Data() const noexcept { return data_; }
+  const ByteVector& Data() const noexcept { return *data_; }
   const auto& Endpoint() const noexcept { return ep_; }
 
+  Priority GetPriority() const noexcept { return priority_; }
+  void SetPriority(Priority p) noexcept { priority_ = p; }
+
  private:
   bi::udp::endpoint ep_;
-  ByteVector data_;
+  std::shared_ptr<const ByteVector> data_;
+  Priority priority_;
+};
+
+// Send queue with separate bounded queue for each priority.
+// When queue of some priority is full, its oldest datagram is dropped.
+// Not thread safe.
+class UdpSendQueue {
+ public:
+  struct Stats {
+    std::atomic<uint64_t> queued{0};
+    std::atomic<uint64_t> dropped{0};
+  };
+
+  UdpSendQueue() {
+    limits_[UdpDatagram::kHigh] = 1024;
+    limits_[UdpDatagram::kNormal] = 2048;
+  }
+
+  const Stats& GetStats(UdpDatagram::Priority p) const noexcept { return stats_[p]; }
+
+  void Push(UdpDatagram&& datagram) {
+    auto p = datagram.GetPriority();
+    auto& queue = queues_[p];
+
+    if (queue.size() >= limits_[p]) {
+      queue.pop_front();
+      ++stats_[p].dropped;
+      --size_;
+    }
+
+    queue.push_back(std::move(datagram));
+    ++stats_[p].queued;
+    ++size_;
+  }
+
+  bool Empty() const noexcept { return size_ == 0; }
+  size_t Size() const noexcept { return size_; }
+
+  // Calls f for first n datagrams in send order.
+  template<class F>
+  void ForEach(size_t n, F f) {
+    for (auto& queue : queues_) {
+      for (auto& datagram : queue) {
+        if (n-- == 0) return;
+        f(datagram);
+      }
+    }
+  }
+
+  UdpDatagram PopFront() {
+    for (auto& queue : queues_) {
+      if (queue.empty()) continue;
+      auto datagram = std::move(queue.front());
+      queue.pop_front();
+      --size_;
+      return datagram;
+    }
+    throw std::out_of_range("empty udp send queue");
+  }
+
+  // Removes first n datagrams in send order.
+  void Pop(size_t n) {
+    for (auto& queue : queues_) {
+      size_t to_remove = std::min(n, queue.size());
+      queue.erase(queue.begin(), queue.begin() + to_remove);
+      size_ -= to_remove;
+      n -= to_remove;
+    }
+  }
+
+  void Clear() noexcept {
+    for (auto& queue : queues_) {
+      queue.clear();
+    }
+    size_ = 0;
+  }
+
+ private:
+  std::array<std::deque<UdpDatagram>, UdpDatagram::kPrioritiesNum> queues_;
+  std::array<size_t, UdpDatagram::kPrioritiesNum> limits_;
+  std::array<Stats, UdpDatagram::kPrioritiesNum> stats_;
+  size_t size_ = 0;
 };
 
 // Interface which socket's owner must implement.
 class UdpSocketEventHandler {
  public:
   virtual ~UdpSocketEventHandler() = default;
-  virtual void OnPacketReceived(const bi::udp::endpoint& from, const ByteVector& data) = 0;
+  // data points to socket's receive buffer, copy it if it's needed after return
+  virtual void OnPacketReceived(const bi::udp::endpoint& from, ByteView data) = 0;
   virtual void OnSocketClosed(const boost::system::error_code&) = 0;
 };
 
@@ -41,6 +153,12 @@ class UdpSocket : public std::enable_shared_from_this<UdpSocket<MaxDatagramSize>
 
   using Ptr = std::shared_ptr<UdpSocket<MaxDatagramSize>>;
 
+  // Max number of datagrams received or sent per one syscall on Linux.
+  static constexpr size_t kBatchSize = 32;
+
+  // Element i is a number of syscalls which moved exactly i datagrams.
+  using BatchHistogram = std::array<std::atomic<uint64_t>, kBatchSize + 1>;
+
   static auto Create(ba::io_context& io, uint16_t port, UdpSocketEventHandler& host) {
     return Ptr(new UdpSocket<MaxDatagramSize>(io, port, host));
   }
@@ -49,7 +167,9 @@ class UdpSocket : public std::enable_shared_from_this<UdpSocket<MaxDatagramSize>
     return Ptr(new UdpSocket<MaxDatagramSize>(io, ep, host));
   }
 
-  void Open();
+  // If reuse_port is true, several sockets can be bound to the same port,
+  // kernel balances incoming datagrams between them.
+  void Open(bool reuse_port = false);
 
   template<class Datagram>
   bool Send(Datagram&& datagram);
@@ -58,6 +178,14 @@ class UdpSocket : public std::enable_shared_from_this<UdpSocket<MaxDatagramSize>
 
   void Close() { CloseWithError(ba::error::connection_reset); }
 
+  const BatchHistogram& GetRecvBatchHistogram() const noexcept { return recv_batches_; }
+  const BatchHistogram& GetSendBatchHistogram() const noexcept { return send_batches_; }
+  static std::string HistogramToString(const BatchHistogram&);
+
+  const UdpSendQueue::Stats& GetQueueStats(UdpDatagram::Priority p) const noexcept {
+    return send_queue_.GetStats(p);
+  }
+
  private:
   UdpSocket(ba::io_context& io, const bi::udp::endpoint& ep, UdpSocketEventHandler& host)
       : listen_ep_(ep), socket_(io), host_(host) {
@@ -75,12 +203,30 @@ class UdpSocket : public std::enable_shared_from_this<UdpSocket<MaxDatagramSize>
   void StartRead();
   void StartWrite();
 
+#ifdef NET_UDP_MMSG
+  void ReadBatch();
+  void WriteBatches(); // doesn't lock send_mux_
+#endif
+
   bi::udp::endpoint listen_ep_;
-  bi::udp::endpoint recv_ep_;
 
   Mutex send_mux_;
-  std::deque<UdpDatagram> send_queue_;
+  UdpSendQueue send_queue_;
+  bool writing_ = false;
+#ifndef NET_UDP_MMSG
+  std::unique_ptr<UdpDatagram> in_flight_;
+#endif
+
+#ifdef NET_UDP_MMSG
+  std::array<bi::udp::endpoint, kBatchSize> recv_eps_;
+  std::array<ByteArray<MaxDatagramSize>, kBatchSize> recv_bufs_;
+#else
+  bi::udp::endpoint recv_ep_;
   ByteArray<MaxDatagramSize> recv_buf_;
+#endif
+
+  BatchHistogram recv_batches_{};
+  BatchHistogram send_batches_{};
 
   bi::udp::socket socket_;
 
@@ -91,13 +237,24 @@ class UdpSocket : public std::enable_shared_from_this<UdpSocket<MaxDatagramSize>
 };
 
 template<size_t MaxDatagramSize>
-void UdpSocket<MaxDatagramSize>::Open() {
+void UdpSocket<MaxDatagramSize>::Open(bool reuse_port) {
   if (started_.load()) return;
   started_.store(true);
 
   socket_.open(bi::udp::v4());
   socket_.set_option(ba::socket_base::reuse_address(true));
 
+#ifdef NET_UDP_REUSEPORT
+  if (reuse_port) {
+    int enable = 1;
+    if (::setsockopt(socket_.native_handle(), SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) != 0) {
+      LOG(ERROR) << "Can't set SO_REUSEPORT on UDP socket, reason " << std::strerror(errno);
+    }
+  }
+#else
+  (void)reuse_port;
+#endif
+
 #ifdef WIN32
   BOOL new_behavior = FALSE;
   DWORD bytes_returned = 0;
@@ -118,13 +275,68 @@ void UdpSocket<MaxDatagramSize>::Open() {
   {
    // don't send stale messages on restart
    Guard g(send_mux_);
-   send_queue_.clear();
+   send_queue_.Clear();
+   writing_ = false;
   }
 
   closed_.store(false);
   StartRead();
 }
 
+#ifdef NET_UDP_MMSG
+template<size_t MaxDatagramSize>
+void UdpSocket<MaxDatagramSize>::StartRead() {
+  if (closed_.load()) return;
+
+  Ptr self(UdpSocket<MaxDatagramSize>::shared_from_this());
+  socket_.async_wait(bi::udp::socket::wait_read,
+          [this, self](const boost::system::error_code& ec) {
+            if (closed_.load()) {
+              return CloseWithError(ec);
+            }
+
+            if (ec) {
+              LOG(ERROR) << "Receive of UDP datagram failed. " << ec.value()
+                         << ", " << ec.message();
+            } else {
+              ReadBatch();
+            }
+
+            StartRead();
+          });
+}
+
+template<size_t MaxDatagramSize>
+void UdpSocket<MaxDatagramSize>::ReadBatch() {
+  std::array<mmsghdr, kBatchSize> msgs{};
+  std::array<iovec, kBatchSize> iovs;
+
+  for (size_t i = 0; i < kBatchSize; ++i) {
+    iovs[i].iov_base = recv_bufs_[i].data();
+    iovs[i].iov_len = MaxDatagramSize;
+    msgs[i].msg_hdr.msg_name = recv_eps_[i].data();
+    msgs[i].msg_hdr.msg_namelen = static_cast<socklen_t>(recv_eps_[i].capacity());
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  int received = ::recvmmsg(socket_.native_handle(), msgs.data(), kBatchSize, MSG_DONTWAIT, nullptr);
+  if (received < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      LOG(ERROR) << "Receive of UDP datagram failed. " << errno << ", " << std::strerror(errno);
+    }
+    return;
+  }
+
+  ++recv_batches_[received];
+
+  for (int i = 0; i < received; ++i) {
+    if (!msgs[i].msg_len) continue;
+    recv_eps_[i].resize(msgs[i].msg_hdr.msg_namelen);
+    host_.OnPacketReceived(recv_eps_[i], ByteView(recv_bufs_[i].data(), msgs[i].msg_len));
+  }
+}
+#else
 template<size_t MaxDatagramSize>
 void UdpSocket<MaxDatagramSize>::StartRead() {
   if (closed_.load()) return;
@@ -142,12 +354,14 @@ void UdpSocket<MaxDatagramSize>::StartRead() {
             }
 
             if (len) {
-                host_.OnPacketReceived(recv_ep_, ByteVector(recv_buf_.begin(), recv_buf_.end()));
+              ++recv_batches_[1];
+              host_.OnPacketReceived(recv_ep_, ByteView(recv_buf_.data(), len));
             }
 
             StartRead();
           });
 }
+#endif
 
 template<size_t MaxDatagramSize>
 template<class Datagram>
@@ -155,23 +369,91 @@ bool UdpSocket<MaxDatagramSize>::Send(Datagram&& datagram) {
   if (closed_.load()) return false;
 
   Guard g(send_mux_);
-  send_queue_.emplace_back(std::forward<Datagram>(datagram));
+  send_queue_.Push(UdpDatagram(std::forward<Datagram>(datagram)));
 
-  if (send_queue_.size() == 1) {
+  if (!writing_) {
+    writing_ = true;
     StartWrite();
   }
 
   return true;
 }
 
+#ifdef NET_UDP_MMSG
 template<size_t MaxDatagramSize>
 void UdpSocket<MaxDatagramSize>::StartWrite() {
   if (closed_.load()) return;
 
-  const auto& datagram = send_queue_[0];
   Ptr self(UdpSocket<MaxDatagramSize>::shared_from_this());
+  socket_.async_wait(bi::udp::socket::wait_write,
+          [this, self](const boost::system::error_code& ec) {
+            if (closed_.load()) {
+              return CloseWithError(ec);
+            }
 
-  socket_.async_send_to(ba::buffer(datagram.Data()), datagram.Endpoint(),
+            Guard g(send_mux_);
+            if (ec) {
+              LOG(ERROR) << "Send of UDP datagram failed. "
+                         << ec.value() << ", " << ec.message();
+              send_queue_.Pop(1);
+            } else {
+              WriteBatches();
+            }
+
+            if (send_queue_.Empty()) {
+              writing_ = false;
+              return;
+            }
+
+            StartWrite();
+          });
+}
+
+template<size_t MaxDatagramSize>
+void UdpSocket<MaxDatagramSize>::WriteBatches() {
+  std::array<mmsghdr, kBatchSize> msgs;
+  std::array<iovec, kBatchSize> iovs;
+
+  while (!send_queue_.Empty()) {
+    const size_t batch_size = std::min(kBatchSize, send_queue_.Size());
+    msgs.fill(mmsghdr{});
+
+    size_t i = 0;
+    send_queue_.ForEach(batch_size, [&](UdpDatagram& datagram) {
+      iovs[i].iov_base = const_cast<uint8_t*>(datagram.Data().data());
+      iovs[i].iov_len = datagram.Data().size();
+      msgs[i].msg_hdr.msg_name = const_cast<sockaddr*>(datagram.Endpoint().data());
+      msgs[i].msg_hdr.msg_namelen = static_cast<socklen_t>(datagram.Endpoint().size());
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+      ++i;
+    });
+
+    int sent = ::sendmmsg(socket_.native_handle(), msgs.data(),
+                          static_cast<unsigned int>(batch_size), MSG_DONTWAIT);
+    if (sent < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+      if (errno == EINTR) continue;
+
+      LOG(ERROR) << "Send of UDP datagram failed. " << errno << ", " << std::strerror(errno);
+      sent = 1; // skip datagram which cannot be sent
+    } else {
+      ++send_batches_[sent];
+    }
+
+    send_queue_.Pop(static_cast<size_t>(sent));
+  }
+}
+#else
+template<size_t MaxDatagramSize>
+void UdpSocket<MaxDatagramSize>::StartWrite() {
+  if (closed_.load()) return;
+
+  // keep datagram out of queue, higher priority ones may be pushed meanwhile
+  in_flight_ = std::make_unique<UdpDatagram>(send_queue_.PopFront());
+  Ptr self(UdpSocket<MaxDatagramSize>::shared_from_this());
+
+  socket_.async_send_to(ba::buffer(in_flight_->Data()), in_flight_->Endpoint(),
           [this, self](const boost::system::error_code& ec, size_t) {
             if (closed_.load()) {
               return CloseWithError(ec);
@@ -180,16 +462,32 @@ void UdpSocket<MaxDatagramSize>::StartWrite() {
             if (ec) {
               LOG(ERROR) << "Send of UDP datagram failed. "
                          << ec.value() << ", " << ec.message();
+            } else {
+              ++send_batches_[1];
             }
 
             Guard g(send_mux_);
-            send_queue_.pop_front();
+            in_flight_.reset();
 
-            if (send_queue_.empty()) return;
+            if (send_queue_.Empty()) {
+              writing_ = false;
+              return;
+            }
 
             StartWrite();
           });
 }
+#endif
+
+template<size_t MaxDatagramSize>
+std::string UdpSocket<MaxDatagramSize>::HistogramToString(const BatchHistogram& histogram) {
+  std::ostringstream os;
+  for (size_t i = 1; i < histogram.size(); ++i) {
+    auto count = histogram[i].load();
+    if (count) os << i << ":" << count << " ";
+  }
+  return os.str();
+}
 
 template<size_t MaxDatagramSize>
 void UdpSocket<MaxDatagramSize>::CloseWithError(const boost::system::error_code& ec) {
@@ -0,0 +1,72 @@
+#ifndef NET_UTILS_DISTANCE_H
+#define NET_UTILS_DISTANCE_H
+
+#include <array>
+#include <cinttypes>
+#include <cstddef>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#include "common.h"
+
+namespace net {
+
+// XOR distance kernels working on 64 bit limbs without NodeId temporaries.
+
+// XOR distance as 64 bit limbs, most significant first,
+// so std::array comparison orders distances numerically.
+using DistanceKey = std::array<uint64_t, 4>;
+
+constexpr uint16_t kIdBits = 256;
+
+// i-th 64 bit limb of id, 0 - most significant
+inline uint64_t IdLimb(const NodeId& id, size_t i) noexcept {
+  auto pn = id.GetPtr();
+  return static_cast<uint64_t>(pn[7 - 2 * i]) << 32 | pn[6 - 2 * i];
+}
+
+// bit of id, 0 - the most significant one
+inline uint8_t IdBit(const NodeId& id, uint16_t bit) noexcept {
+  return static_cast<uint8_t>(IdLimb(id, bit / 64) >> (63 - bit % 64) & 1);
+}
+
+// x must not be 0
+inline uint16_t Clz64(uint64_t x) noexcept {
+#if defined(_MSC_VER)
+  unsigned long index;
+  _BitScanReverse64(&index, x);
+  return static_cast<uint16_t>(63 - index);
+#else
+  return static_cast<uint16_t>(__builtin_clzll(x));
+#endif
+}
+
+// Number of leading zero bits of a ^ b, kIdBits if a == b.
+inline uint16_t XorClz(const NodeId& a, const NodeId& b) noexcept {
+  for (size_t i = 0; i < 4; ++i) {
+    auto x = IdLimb(a, i) ^ IdLimb(b, i);
+    if (x) return static_cast<uint16_t>(i * 64 + Clz64(x));
+  }
+  return kIdBits;
+}
+
+inline DistanceKey XorDistance(const NodeId& a, const NodeId& b) noexcept {
+  return {IdLimb(a, 0) ^ IdLimb(b, 0), IdLimb(a, 1) ^ IdLimb(b, 1),
+          IdLimb(a, 2) ^ IdLimb(b, 2), IdLimb(a, 3) ^ IdLimb(b, 3)};
+}
+
+// Distances from one target to contiguous ids,
+// target limbs are loaded once and loop has no early exits.
+inline void XorDistances(const NodeId& target, const NodeId* ids, size_t n, DistanceKey* out) noexcept {
+  const DistanceKey t = {IdLimb(target, 0), IdLimb(target, 1), IdLimb(target, 2), IdLimb(target, 3)};
+  for (size_t j = 0; j < n; ++j) {
+    for (size_t i = 0; i < 4; ++i) {
+      out[j][i] = t[i] ^ IdLimb(ids[j], i);
+    }
+  }
+}
+
+} // namespace net
+#endif // NET_UTILS_DISTANCE_H
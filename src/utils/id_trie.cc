@@ -0,0 +1,132 @@
+#include "utils/id_trie.h"
+
+#include <array>
+
+namespace net {
+
+void IdTrie::Insert(const NodeId& id, uint32_t value) {
+  if (root_ == kNone) {
+    root_ = NewLeaf(id, value);
+    ++size_;
+    return;
+  }
+
+  auto& closest = leaves_[LeafIndex(FindLeaf(id))];
+  auto bit = XorClz(id, closest.id);
+  if (bit == kIdBits) {
+    closest.value = value;
+    return;
+  }
+
+  // allocate before taking pointers into vectors
+  auto leaf = NewLeaf(id, value);
+  auto inner = NewInner();
+
+  // new inner node goes above the first node splitting at a later bit
+  uint32_t* place = &root_;
+  while (!IsLeaf(*place) && inners_[*place].bit < bit) {
+    auto& n = inners_[*place];
+    place = &n.child[IdBit(id, n.bit)];
+  }
+
+  auto dir = IdBit(id, bit);
+  auto& n = inners_[inner];
+  n.bit = bit;
+  n.child[dir] = leaf;
+  n.child[!dir] = *place;
+  *place = inner;
+  ++size_;
+}
+
+bool IdTrie::Erase(const NodeId& id) {
+  if (root_ == kNone) return false;
+
+  uint32_t* place = &root_;
+  uint32_t* parent_place = nullptr;
+  while (!IsLeaf(*place)) {
+    parent_place = place;
+    auto& n = inners_[*place];
+    place = &n.child[IdBit(id, n.bit)];
+  }
+
+  auto leaf = LeafIndex(*place);
+  if (leaves_[leaf].id != id) return false;
+  free_leaves_.push_back(leaf);
+
+  if (!parent_place) {
+    root_ = kNone;
+  } else {
+    // sibling takes place of parent
+    auto parent = *parent_place;
+    auto& n = inners_[parent];
+    *parent_place = n.child[0] == *place ? n.child[1] : n.child[0];
+    free_inners_.push_back(parent);
+  }
+
+  --size_;
+  return true;
+}
+
+bool IdTrie::Find(const NodeId& id, uint32_t& value) const noexcept {
+  if (root_ == kNone) return false;
+
+  auto& leaf = leaves_[LeafIndex(FindLeaf(id))];
+  if (leaf.id != id) return false;
+
+  value = leaf.value;
+  return true;
+}
+
+void IdTrie::Closest(const NodeId& target, size_t k, std::vector<uint32_t>& result) const {
+  if (root_ == kNone) return;
+
+  // farther siblings of current path, at most one per inner node on it
+  std::array<uint32_t, kIdBits + 1> stack;
+  size_t top = 0;
+  stack[top++] = root_;
+
+  for (size_t found = 0; top && found < k; ++found) {
+    auto ref = stack[--top];
+    while (!IsLeaf(ref)) {
+      auto& n = inners_[ref];
+      auto dir = IdBit(target, n.bit);
+      stack[top++] = n.child[!dir];
+      ref = n.child[dir];
+    }
+    result.push_back(leaves_[LeafIndex(ref)].value);
+  }
+}
+
+uint32_t IdTrie::NewLeaf(const NodeId& id, uint32_t value) {
+  uint32_t index;
+  if (!free_leaves_.empty()) {
+    index = free_leaves_.back();
+    free_leaves_.pop_back();
+    leaves_[index] = {id, value};
+  } else {
+    index = static_cast<uint32_t>(leaves_.size());
+    leaves_.push_back({id, value});
+  }
+  return index | kLeafFlag;
+}
+
+uint32_t IdTrie::NewInner() {
+  if (!free_inners_.empty()) {
+    auto index = free_inners_.back();
+    free_inners_.pop_back();
+    return index;
+  }
+
+  inners_.emplace_back();
+  return static_cast<uint32_t>(inners_.size() - 1);
+}
+
+uint32_t IdTrie::FindLeaf(const NodeId& id) const noexcept {
+  auto ref = root_;
+  while (!IsLeaf(ref)) {
+    auto& n = inners_[ref];
+    ref = n.child[IdBit(id, n.bit)];
+  }
+  return ref;
+}
+} // namespace net
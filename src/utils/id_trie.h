@@ -0,0 +1,61 @@
+#ifndef NET_UTILS_ID_TRIE_H
+#define NET_UTILS_ID_TRIE_H
+
+#include <limits>
+#include <vector>
+
+#include "common.h"
+#include "utils/distance.h"
+
+namespace net {
+
+// Binary radix (crit-bit) trie over NodeIds with uint32_t values.
+// Each inner node keeps the first bit its subtrees differ in,
+// so depth is bounded by number of ids and by kIdBits.
+// Depth first walk towards target visits ids in order of XOR distance,
+// so k closest are found in O(k + depth). Not thread safe.
+class IdTrie {
+ public:
+  // replaces value if id exists
+  void Insert(const NodeId&, uint32_t value);
+  bool Erase(const NodeId&);
+  bool Find(const NodeId&, uint32_t& value) const noexcept;
+  size_t Size() const noexcept { return size_; }
+
+  // Appends values of at most k ids closest to target, nearest first.
+  void Closest(const NodeId& target, size_t k, std::vector<uint32_t>&) const;
+
+ private:
+  // references to children, leaves are marked by kLeafFlag
+  static constexpr uint32_t kLeafFlag = 1u << 31;
+  static constexpr uint32_t kNone = std::numeric_limits<uint32_t>::max();
+
+  struct Inner {
+    uint32_t child[2];
+    uint16_t bit;
+  };
+
+  struct Leaf {
+    NodeId id;
+    uint32_t value;
+  };
+
+  static bool IsLeaf(uint32_t ref) noexcept { return ref & kLeafFlag; }
+  static uint32_t LeafIndex(uint32_t ref) noexcept { return ref & ~kLeafFlag; }
+
+  // return references, freed slots are reused
+  uint32_t NewLeaf(const NodeId&, uint32_t value);
+  uint32_t NewInner();
+
+  // leaf which id would be compared to
+  uint32_t FindLeaf(const NodeId&) const noexcept;
+
+  std::vector<Inner> inners_;
+  std::vector<Leaf> leaves_;
+  std::vector<uint32_t> free_inners_;
+  std::vector<uint32_t> free_leaves_;
+  uint32_t root_ = kNone;
+  size_t size_ = 0;
+};
+} // namespace net
+#endif // NET_UTILS_ID_TRIE_H
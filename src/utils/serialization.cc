@@ -3,7 +3,7 @@
 namespace net {
 
 void Serializer::Put(const std::string& s) {
-  Put(s.size());
+  PutVarint(s.size());
   buffer_.insert(buffer_.end(), s.cbegin(), s.cend());
 }
 
@@ -12,13 +12,21 @@ void Serializer::Put(const uint8_t* data, size_t size) {
 }
 
 void Serializer::Put(const std::vector<uint8_t>& data) {
-  Put(data.size());
+  PutVarint(data.size());
   Put(data.data(), data.size());
 }
 
+void Serializer::PutVarint(uint64_t value) {
+  while (value >= 0x80) {
+    buffer_.push_back(static_cast<uint8_t>(value | 0x80));
+    value >>= 7;
+  }
+  buffer_.push_back(static_cast<uint8_t>(value));
+}
+
 bool Unserializer::Get(std::string& s) {
-  size_t size;
-  if (!Get(size) || size > size_) {
+  uint64_t size;
+  if (!GetVarint(size) || size > size_) {
     return false;
   }
 
@@ -40,9 +48,25 @@ bool Unserializer::Get(uint8_t* data, size_t size) {
   return true;
 }
 
+bool Unserializer::GetVarint(uint64_t& value) {
+  auto ptr = reinterpret_cast<const uint8_t**>(&data_);
+  value = 0;
+
+  for (uint8_t shift = 0; shift < 64 && size_; shift += 7) {
+    uint8_t byte = **ptr;
+    ++*ptr;
+    --size_;
+
+    value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) return true;
+  }
+
+  return false;
+}
+
 bool Unserializer::Get(std::vector<uint8_t>& data) {
-  size_t size;
-  if (!Get(size)) return false;
+  uint64_t size;
+  if (!GetVarint(size) || size > size_) return false;
   data.resize(size);
   return Get(data.data(), data.size());
 }
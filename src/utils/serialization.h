@@ -10,6 +10,13 @@
 
 namespace net {
 
+// Max size of LEB128 encoded uint64_t.
+constexpr size_t kMaxVarintSize = 10;
+
+// Wire types: raw bytes, Put/GetFixed - little endian integers,
+// Put/GetVarint - LEB128 unsigned integers, byte vectors and strings
+// are prefixed with varint length. Put/Get of integers keep
+// host byte order and are not intended for network.
 class Serializer {
  public:
   using Data = std::vector<uint8_t>;
@@ -18,6 +25,11 @@ class Serializer {
 
   const Data& GetData() const noexcept { return buffer_; }
 
+  // Moves serialized data out, serializer becomes empty.
+  Data Release() noexcept { return std::move(buffer_); }
+
+  void Reserve(size_t size) { buffer_.reserve(size); }
+
   template<class T,
            class = std::enable_if_t<std::is_class<T>::value>>
   decltype(auto) Put(const T& data) {
@@ -31,10 +43,22 @@ class Serializer {
     buffer_.insert(buffer_.end(), ptr, ptr + sizeof(Integer));
   }
 
+  template<class Integer,
+           class = std::enable_if_t<std::is_integral<Integer>::value>>
+  void PutFixed(Integer data) {
+    auto value = static_cast<std::make_unsigned_t<Integer>>(data);
+    for (size_t i = 0; i < sizeof(Integer); ++i) {
+      buffer_.push_back(static_cast<uint8_t>(value >> (8 * i)));
+    }
+  }
+
   void Put(const std::string&);
   void Put(const uint8_t*, size_t);
   void Put(const std::vector<uint8_t>&);
 
+  // LEB128, 1 byte for values less than 128, up to 10 bytes.
+  void PutVarint(uint64_t);
+
   template<size_t SIZE>
   void Put(const std::array<uint8_t, SIZE>& data) {
     Put(data.data(), SIZE);
@@ -70,10 +94,30 @@ class Unserializer {
     return true;
   }
 
+  template<class Integer,
+           class = std::enable_if_t<std::is_integral<Integer>::value>>
+  bool GetFixed(Integer& integer) {
+    if (size_ < sizeof(Integer)) return false;
+
+    auto ptr = reinterpret_cast<const uint8_t**>(&data_);
+    std::make_unsigned_t<Integer> value = 0;
+    for (size_t i = 0; i < sizeof(Integer); ++i) {
+      value |= static_cast<std::make_unsigned_t<Integer>>((*ptr)[i]) << (8 * i);
+    }
+    integer = static_cast<Integer>(value);
+    *ptr += sizeof(Integer);
+    size_ -= sizeof(Integer);
+    return true;
+  }
+
   bool Get(std::string&);
   bool Get(uint8_t*, size_t);
   bool Get(std::vector<uint8_t>&);
 
+  bool GetVarint(uint64_t&);
+
+  size_t Remaining() const noexcept { return size_; }
+
   template<size_t SIZE>
   bool Get(std::array<uint8_t, SIZE>& data) {
     return Get(data.data(), SIZE);